@@ -15,11 +15,7 @@ public:
 	class Place; // create a placing action with position and tile
 
 public:
-	virtual Board::Reward apply(Board& b) const {
-		auto proto = entries().find(type());
-		if (proto != entries().end()) return proto->second->reinterpret(this).apply(b);
-		return -1;
-	}
+	inline Board::Reward apply(Board& b) const; // branch on type(), defined below the action types
 	virtual std::ostream& operator >>(std::ostream& out) const {
 		auto proto = entries().find(type());
 		if (proto != entries().end()) return proto->second->reinterpret(this) >> out;
@@ -126,3 +122,17 @@ protected:
 	Action& reinterpret(const Action* a) const override { return *new (const_cast<Action*>(a)) Place(*a); }
 	static __attribute__((constructor)) void init() { entries()[type_flag('p')] = new Place; }
 };
+
+
+// --------------------------------------------------------------------------------- //
+/**
+ * apply the action without going through the prototype table
+ * the prototypes are only needed to parse and print actions
+ */
+Board::Reward Action::apply(Board& b) const {
+	switch (type()) {
+	case Slide::type: return b.slide(event());
+	case Place::type: return b.place(event() & 0x0f, event() >> 4);
+	default:          return -1;
+	}
+}
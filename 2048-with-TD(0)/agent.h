@@ -7,11 +7,22 @@
 #include <type_traits>
 #include <algorithm>
 #include <fstream>
+#include <iostream>
 #include <chrono>
+#include <limits>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "transposition.h"
+#include "thread_pool.h"
+#include "checkpoint.h"
 
 #define debug(a) std::cout << #a << " = " << a << std::endl
 
@@ -96,27 +107,45 @@ public:
     }
 
     virtual ~WeightAgent() {
-        if (meta.find("save") != meta.end()) // pass save=... to save to a specific file
-            save_weights(meta["save"]);
+        if (meta.find("save") != meta.end()) { // pass save=... to save to a specific file
+            try {
+                save_weights(meta["save"]);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
     }
 
+    /**
+     * load a version 2 weight file by mapping it (see weight_file), or read a file of the former
+     * format, which is a table count followed by each table as its size and entries
+     * pass verify=1 to check the checksum of a version 2 file, which reads all of its pages
+     * throw std::runtime_error if the file cannot be loaded
+     */
     virtual void load_weights(const std::string &path) {
+        if (weight_file::detect(path)) {
+            bool verify = meta.find("verify") != meta.end() && int(meta["verify"]);
+            mapping = weight_file::load(path, net, layout, verify);
+            return;
+        }
+
         std::ifstream in(path, std::ios::in | std::ios::binary);
-        if (!in.is_open()) std::exit(-1);
+        if (!in.is_open()) throw std::runtime_error("cannot open weight file '" + path + "'");
         uint32_t size;
         in.read(reinterpret_cast<char *>(&size), sizeof(size));
         net.resize(size);
         for (weight &w : net) in >> w;
+        if (!in) throw std::runtime_error("weight file '" + path + "' is truncated");
         in.close();
+        layout.clear();
     }
 
+    /**
+     * save the tables as a version 2 weight file
+     * throw std::runtime_error if the file cannot be written
+     */
     virtual void save_weights(const std::string &path) {
-        std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-        if (!out.is_open()) std::exit(-1);
-        uint32_t size = net.size();
-        out.write(reinterpret_cast<char *>(&size), sizeof(size));
-        for (weight &w : net) out << w;
-        out.close();
+        weight_file::save(path, net, layout);
     }
 
 protected:
@@ -128,6 +157,9 @@ protected:
 
 protected:
     std::vector<weight> net;
+    std::string layout;             // describes the network the tables belong to, empty if unknown
+    std::shared_ptr<void> mapping;  // the mapped weight file the tables point into, if any
+    std::vector<weight> blocks;     // the blocks of memory the tables point into, if any
 };
 
 /**
@@ -161,19 +193,15 @@ class RandomEnv : public RandomAgent {
 public:
     RandomEnv(const std::string &args = "") : RandomAgent("name=random role=environment " + args),
                                               space({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}),
-                                              bag({1, 2, 3}),
                                               top({0, 1, 2, 3}),
                                               bottom({12, 13, 14, 15}),
                                               left({0, 4, 8, 12}),
                                               right({3, 7, 11, 15}) {
-        engine.seed(std::chrono::system_clock::now().time_since_epoch().count());
+        if (meta.find("seed") == meta.end()) // seed=... is already applied by RandomAgent
+            engine.seed(std::chrono::system_clock::now().time_since_epoch().count());
         num_moves = 0;
     }
 
-    virtual void close_episode(const std::string &flag = "") {
-        bag.assign({1, 2, 3});
-    }
-
     unsigned opponent_type() override {
         return Action::Slide::type;
     }
@@ -187,15 +215,17 @@ public:
         else if (opponent_action.event() == 2) { tiles = &top;  }    // down
         else if (opponent_action.event() == 3) { tiles = &right;  }  // left
 
-        if (bag.empty()) bag.assign({1, 2, 3});
-        std::shuffle(bag.begin(), bag.end(), engine);
+        // draw one of the tiles left in the bag, which the board keeps
+        unsigned bag = board.bag();
+        for (int skip = std::uniform_int_distribution<int>(0, __builtin_popcount(bag) - 1)(engine); skip > 0; skip--) bag &= bag - 1;
+        Board::Cell tile = __builtin_ctz(bag) + 1;
         std::shuffle(tiles->begin(), tiles->end(), engine);
 
         num_moves++;
 
+        unsigned empty = board.empty_cells();
         for (auto it = tiles->begin(); it < tiles->end(); it++) {
-            if (board.get_cell(*it) != 0) continue;
-            Board::Cell tile = bag.back();   bag.pop_back();
+            if (!(empty & (1u << *it))) continue;
             return Action::Place(*it, tile);
         }
         return Action();
@@ -204,7 +234,6 @@ public:
 private:
     std::vector<int> space;
     std::vector<int> top, bottom, left, right;
-    std::vector<int> bag;
     int num_moves;
 };
 
@@ -222,10 +251,10 @@ public:
     }
 
     virtual Action take_action(const Board &board, const Action &opponent_action) {
+        unsigned legal = board.legal_moves();
         std::shuffle(opcode.begin(), opcode.end(), engine);
         for (int op : opcode) {
-            Board::Reward reward = Board(board).slide(op);
-            if (reward != -1) return Action::Slide(op);
+            if (legal & (1u << op)) return Action::Slide(op);
         }
         return Action();
     }
@@ -237,8 +266,6 @@ private:
 class TDPlayer : public WeightAgent {
 
 public:
-    int num_tuple;
-    int tuple_len;
     int num_tile;
 
     struct State {
@@ -250,31 +277,79 @@ public:
 
 
     float learning_rate;
-    int tuple_index[4][6] = {
-            { 0,  1,  2,  3,  4,  5},
-            { 4,  5,  6,  7,  8,  9},
-            { 5,  6,  7,  9, 10, 11},
-            { 9, 10, 11, 13, 14, 15},
+    float lambda;   // TD(lambda) trace decay, 0 for TD(0)
+    int nstep;      // steps of the n-step return, 1 for TD(0)
+    std::vector<weight>* active_weights; // the tables to evaluate and train, net unless shared with another player
+    std::vector<qweight> qnet;    // the quantized tables replacing them in a quantized player
+    std::shared_ptr<Checkpoint> checkpoint; // shared with the training workers of this player
+
+    /**
+     * one n-tuple read from one isomorphic board, with its cells gathered in place from the grid:
+     * by pext with 'mask' when the target has BMI2, otherwise by one shift and mask per run of
+     * adjacent cells, so any pattern takes a few operations instead of a loop over its cells
+     */
+    struct Feature {
+        unsigned table;     // weight table of the pattern
+        unsigned iso;       // isomorphic board the tuple is read from (see get_index)
+        unsigned cells;
+        Board::Grid mask;
+        unsigned runs;
+        unsigned shift[8];
+        Board::Grid bits[8];
     };
 
-    int num_player_action;
-    int num_evil_action;
-    int tree_depth;
+    static constexpr unsigned kMaxCells = 8;
+    static constexpr unsigned kMaxFeatures = 64;
 
-    struct Node {
-        double value;
-        Board board;
-        int last_op;
-        std::vector<Node*> children;
+    std::vector<std::vector<int>> patterns; // cells of each n-tuple, in ascending order
+    unsigned iso;                           // number of isomorphic boards sharing the tables
+    std::vector<Feature> features;
+
+    unsigned num_stage;                     // number of networks, each for a range of the largest tile
+    std::array<unsigned, 16> stage_of;      // stage of each largest tile, e.g. stage_of[max_cell()]
+    std::vector<unsigned> stage_cells;      // smallest largest tile (index value) of each stage after the first
 
-        Node() {
-            value = 0;
-            last_op = -1;
-            board = Board();
+    int search_depth;
+    int search_budget;
+
+    std::chrono::steady_clock::time_point search_deadline;
+    bool search_timed;
+    std::atomic<bool> search_aborted;
+
+    /**
+     * per-thread state of the search
+     */
+    struct Searcher {
+        TranspositionTable tt;
+        size_t nodes = 0;
+        size_t star1_cuts = 0;
+        size_t probe_cuts = 0;
+
+        friend std::ostream& operator <<(std::ostream& out, const Searcher& sr) {
+            out << sr.tt << std::endl << "search: " << sr.nodes << " max nodes" << std::endl;
+            return out << "prune: " << sr.star1_cuts << " star1 cuts, " << sr.probe_cuts << " probe cuts";
         }
     };
 
-    Node root;
+    /**
+     * value returned by the bounded search: exact (bound = 0), or only a lower bound (bound > 0)
+     * or an upper bound (bound < 0) of the true value when the search failed high or low
+     */
+    struct SearchValue {
+        float value;
+        int bound;
+    };
+
+    static constexpr double infinity = std::numeric_limits<double>::infinity();
+
+    bool prune;
+    bool bounds_ready;
+    double value_lower;
+    double value_upper;
+    std::vector<double> upper_table;
+
+    std::vector<Searcher> searchers;
+    std::unique_ptr<ThreadPool> pool;
 
     int place_pos[4][4] = {
             {12, 13, 14, 15},
@@ -287,100 +362,371 @@ public:
     std::map<unsigned long long, int> v_map;
 
 public:
-    TDPlayer(const std::string &args = "") : WeightAgent(args) {
-        num_tuple = 4;  tuple_len = 6;  num_tile = 15;
-        num_player_action = 4;   num_evil_action = 12;  tree_depth = 2;
-        learning_rate = 0.025;
-
+    TDPlayer(const std::string &args = "") : WeightAgent(args), active_weights(&net) {
+        num_tile = 15;  iso = 1;  num_stage = 1;  stage_of.fill(0);
+        search_depth = 1;  search_budget = 0;
+        search_timed = false;  search_aborted = false;
+        prune = false;  bounds_ready = false;  value_lower = 0;  value_upper = 0;
+        learning_rate = 0.025;  lambda = 0;  nstep = 1;
+
+        play_mode = 0;
         if (meta.find("mode") != meta.end()) {
             if (meta["mode"].value == "train") play_mode = 0;
             else play_mode = 1;
         }
 
-        int num_element = 1;
-        for(int i = 0; i < tuple_len; i++) num_element *= num_tile;
+        // pass tuples=... to set the n-tuples, cells separated by ',' and tuples by ';'
+        // and iso=... to share each table among 1, 2, 4, or 8 isomorphic boards
+        std::string tuples = "0,1,2,3,4,5;4,5,6,7,8,9;5,6,7,9,10,11;9,10,11,13,14,15";
+        if (meta.find("tuples") != meta.end()) tuples = meta["tuples"].value;
+        if (meta.find("iso") != meta.end()) iso = int(meta["iso"]);
+        make_features(tuples);
+
+        // pass stages=... to train a separate network for each range of the largest tile, e.g.
+        // stages=384,1536 uses one below 384, one from 384 up to 768, and one from 1536 up
+        if (meta.find("stages") != meta.end()) make_stages(meta["stages"].value);
+
+        std::vector<size_t> num_element(patterns.size(), 1);
+        for (size_t i = 0; i < patterns.size(); i++) {
+            for (size_t c = 0; c < patterns[i].size(); c++) num_element[i] *= num_tile;
+        }
         if (net.empty()) {
-            for (int i = 0; i < num_tuple; i++)
-                net.emplace_back(num_element, 0);  // create 4 tables for 6-tuple network
+            // the tables of a stage are laid out back to back in one block, and the blocks in
+            // order of the stages, so that net[stage * patterns.size() + pattern] is a view
+            blocks.reserve(num_stage);
+            for (unsigned stage = 0; stage < num_stage; stage++) {
+                size_t total = 0;
+                for (size_t n : num_element) total += n;
+                blocks.emplace_back(total, 0);
+                float* block = &blocks.back()[0];
+                for (size_t n : num_element) {
+                    net.push_back(weight::view(block, n));  // create a table for each n-tuple
+                    block += n;
+                }
+            }
         }
+        if (net.size() != patterns.size() * num_stage) throw std::invalid_argument("weight tables do not match the n-tuples");
+        for (size_t i = 0; i < net.size(); i++) {
+            if (net[i].size() != num_element[i % patterns.size()]) throw std::invalid_argument("weight tables do not match the n-tuples");
+        }
+        if (layout.size() && layout != network_layout())
+            throw std::invalid_argument("weight tables of '" + layout + "' do not match '" + network_layout() + "'");
+        layout = network_layout();
+
+        // pass checkpoint_every=... to save the tables every so many trained episodes in the
+        // background, to checkpoint=... if given or else to save=...
+        if (meta.find("checkpoint_every") != meta.end()) {
+            std::string path = meta.find("checkpoint") != meta.end() ? meta["checkpoint"].value
+                             : meta.find("save") != meta.end() ? meta["save"].value : "";
+            if (play_mode != 0 || path.empty()) throw std::invalid_argument("checkpoints need training mode and a path");
+            checkpoint = std::make_shared<Checkpoint>(path, size_t(meta["checkpoint_every"]), layout);
+        }
+
+        // pass lambda=... to train on lambda-returns, or nstep=... to train on n-step returns
+        if (meta.find("lambda") != meta.end()) lambda = float(meta["lambda"]);
+        if (meta.find("nstep") != meta.end()) nstep = int(meta["nstep"]);
+        if (lambda < 0 || lambda > 1) throw std::invalid_argument("lambda must be in [0, 1]");
+        if (nstep < 1) throw std::invalid_argument("nstep must be at least 1");
+        if (lambda > 0 && nstep > 1) throw std::invalid_argument("lambda and nstep cannot be combined");
+
+        // pass quant=1 to play with 16-bit quantized tables, the float tables are released
+        if (meta.find("quant") != meta.end() && int(meta["quant"])) {
+            if (play_mode == 0 || meta.find("save") != meta.end())
+                throw std::invalid_argument("quantized tables are for playing only and cannot be trained or saved");
+            for (weight& w : net) {
+                qnet.emplace_back(w);
+                w = weight();
+            }
+            blocks.clear();
+            mapping.reset();
+        }
+
+        if (meta.find("depth") != meta.end()) // pass depth=... to set the number of slides searched in playing mode
+            search_depth = int(meta["depth"]);
+        if (meta.find("budget_ms") != meta.end()) { // pass budget_ms=... to deepen the search until the time is up
+            search_budget = int(meta["budget_ms"]);
+            if (meta.find("depth") == meta.end()) search_depth = 8; // then depth=... caps the deepening
+        }
+        if (meta.find("prune") != meta.end()) // pass prune=1 to enable the Star1 pruning of chance nodes
+            prune = int(meta["prune"]);
+        if (play_mode == 1) {
+            // pass threads=... to search with more threads, and tt=... to set the total size
+            // of their transposition tables in MB, 0 to disable, which the threads split evenly
+            unsigned threads = meta.find("threads") != meta.end() ? std::max(int(meta["threads"]), 1) : 1;
+            size_t tt_size = meta.find("tt") != meta.end() ? size_t(meta["tt"]) : 16;
+            searchers.resize(threads);
+            for (Searcher& sr : searchers) sr.tt.resize((tt_size << 20) / threads);
+            if (threads > 1) pool.reset(new ThreadPool(threads));
+        } else {
+            searchers.resize(1);
+        }
+    }
+
+    /**
+     * tag of the worker constructors, which share the weight tables rather than copy them
+     */
+    struct Worker {};
+
+    /**
+     * a player is never copied, since a copy would silently train the tables of the original
+     */
+    TDPlayer(const TDPlayer&) = delete;
+    TDPlayer& operator =(const TDPlayer&) = delete;
+
+    /**
+     * a training worker that plays its own episodes but reads and updates the weights of 'shared'
+     * workers of the multi-threaded trainer update the tables without any locking (Hogwild),
+     * so a concurrent update may occasionally be lost, which the training tolerates
+     * a worker has no quantized tables, search threads or transposition table of 'shared'
+     */
+    TDPlayer(Worker, TDPlayer &shared) : TDPlayer(Worker(), shared, shared.weights()) {}
 
-        if (play_mode == 1) generate_tree(root, tree_depth);
+    /**
+     * a worker with the settings of 'shared' that plays with the given weight tables instead,
+     * e.g. an actor playing with a snapshot of the weights of the learner
+     */
+    TDPlayer(Worker, TDPlayer &shared, std::vector<weight> &tables) : WeightAgent("name=" + shared.name() + " role=" + shared.role()), active_weights(&tables) {
+        num_tile = shared.num_tile;  iso = shared.iso;
+        patterns = shared.patterns;  features = shared.features;
+        num_stage = shared.num_stage;  stage_of = shared.stage_of;  stage_cells = shared.stage_cells;
+        search_depth = shared.search_depth;  search_budget = shared.search_budget;
+        search_timed = false;  search_aborted = false;
+        prune = shared.prune;  bounds_ready = false;  value_lower = 0;  value_upper = 0;
+        learning_rate = shared.learning_rate;  lambda = shared.lambda;  nstep = shared.nstep;
+        checkpoint = shared.checkpoint;
+        play_mode = shared.play_mode;
+        searchers.resize(1);
+    }
+
+    std::vector<weight>& weights() { return *active_weights; }
+    const std::vector<weight>& weights() const { return *active_weights; }
+
+    /**
+     * play with 'tables' from now on, e.g. an actor moving on to a newer snapshot of the weights
+     */
+    void use_weights(std::vector<weight>& tables) { active_weights = &tables; }
+
+    /**
+     * wait for the checkpoints in progress before the final save=..., so that an older
+     * checkpoint written to the same path cannot replace the final weights
+     */
+    virtual ~TDPlayer() {
+        if (checkpoint && meta.find("save") != meta.end()) checkpoint->flush();
     }
 
     virtual void open_episode(const std::string &flag = "") {
         ep.clear();
     }
 
-    int get_LUT_index(const Board& s, int index) {
-        int res = 0, base = 1;
-        for (int i = 0; i < tuple_len; i++) {
-            res += int(s.get_cell(tuple_index[index][i])) * base;
-            base *= num_tile;
+    /**
+     * parse the n-tuples and build a feature for every tuple on every isomorphic board
+     * the cells of a tuple are sorted, which only relabels the entries of its table
+     */
+    void make_features(const std::string& tuples) {
+        if (iso != 1 && iso != 2 && iso != 4 && iso != 8) throw std::invalid_argument("iso must be 1, 2, 4, or 8");
+
+        patterns.clear();
+        std::stringstream list(tuples);
+        for (std::string tuple; std::getline(list, tuple, ';'); ) {
+            std::vector<int> cells;
+            std::stringstream cell_list(tuple);
+            for (std::string cell; std::getline(cell_list, cell, ','); ) {
+                if (cell.empty() || cell.size() > 2 || cell.find_first_not_of("0123456789") != std::string::npos) throw std::invalid_argument("invalid n-tuple '" + tuple + "'");
+                cells.push_back(std::stoi(cell));
+            }
+            std::sort(cells.begin(), cells.end());
+            if (cells.empty() || cells.size() > kMaxCells || cells.front() < 0 || cells.back() > 15
+                || std::adjacent_find(cells.begin(), cells.end()) != cells.end()) {
+                throw std::invalid_argument("invalid n-tuple '" + tuple + "'");
+            }
+            patterns.push_back(cells);
         }
-        return res;
+        if (patterns.empty() || patterns.size() * iso > kMaxFeatures) throw std::invalid_argument("invalid number of n-tuples");
+
+        features.clear();
+        for (unsigned table = 0; table < patterns.size(); table++) {
+            const std::vector<int>& cells = patterns[table];
+            Feature f = {};
+            f.table = table;
+            f.cells = cells.size();
+            for (unsigned d = 0; d < cells.size(); d++) {
+                f.mask |= Board::Grid(0xf) << (cells[d] << 2);
+                if (d == 0 || cells[d] != cells[d - 1] + 1) f.shift[f.runs++] = (cells[d] - d) << 2;
+                f.bits[f.runs - 1] |= Board::Grid(0xf) << (d << 2);
+            }
+            for (f.iso = 0; f.iso < iso; f.iso++) features.push_back(f);
+        }
+    }
+
+    /**
+     * parse the tiles starting the stages after the first, in ascending order
+     */
+    void make_stages(const std::string& tiles) {
+        stage_cells.clear();
+        std::stringstream list(tiles);
+        for (std::string tile; std::getline(list, tile, ','); ) {
+            if (tile.empty() || tile.size() > 5 || tile.find_first_not_of("0123456789") != std::string::npos) throw std::invalid_argument("invalid stage tile '" + tile + "'");
+            const Board::Cell* value = std::find(Board::kTileValue + 1, Board::kTileValue + 15, Board::Cell(std::stoi(tile)));
+            unsigned cell = value - Board::kTileValue;
+            if (cell >= 15 || (stage_cells.size() && cell <= stage_cells.back())) throw std::invalid_argument("invalid stage tile '" + tile + "'");
+            stage_cells.push_back(cell);
+        }
+        num_stage = stage_cells.size() + 1;
+        for (unsigned cell = 0; cell < 16; cell++) {
+            stage_of[cell] = std::upper_bound(stage_cells.begin(), stage_cells.end(), cell) - stage_cells.begin();
+        }
+    }
+
+    /**
+     * index in the weights of the first table of the network evaluating the board
+     * a single-stage network skips the scan for the largest tile
+     */
+    size_t stage_base(const Board& s) const {
+        if (num_stage == 1) return 0;
+        return stage_of[s.max_cell()] * patterns.size();
+    }
+
+    /**
+     * the n-tuples, isomorphisms, and stages, as stored with the weight tables in a weight file
+     * a single stage is left out, so that files of single-stage networks keep their layout
+     */
+    std::string network_layout() const {
+        std::string tuples;
+        for (const std::vector<int>& cells : patterns) {
+            for (int cell : cells) tuples += std::to_string(cell) + ',';
+            tuples.back() = ';';
+        }
+        tuples.pop_back();
+        std::string stages;
+        for (unsigned cell : stage_cells) stages += std::to_string(Board::kTileValue[cell]) + ',';
+        if (stages.size()) stages = " stages=" + stages.substr(0, stages.size() - 1);
+        return "tuples=" + tuples + " iso=" + std::to_string(iso) + stages;
+    }
+
+    /**
+     * weight-table index of each feature on the board
+     * isomorphic board k is the board transposed if k & 4, then reflected horizontally if k & 1,
+     * and vertically if k & 2
+     */
+    void get_index(const Board& s, uint32_t (&index)[kMaxFeatures]) const {
+        Board::Grid grid[8];
+        for (unsigned k = 0; k < iso; k++) {
+            Board b(s);
+            if (k & 4) b.transpose();
+            if (k & 1) b.reflect_horizontal();
+            if (k & 2) b.reflect_vertical();
+            grid[k] = b.get_tile();
+        }
+        for (size_t i = 0; i < features.size(); i++) index[i] = feature_index(features[i], grid[features[i].iso]);
+    }
+
+    static uint32_t feature_index(const Feature& f, Board::Grid t) {
+#if defined(__BMI2__)
+        Board::Grid id = _pext_u64(t, f.mask);
+#else
+        Board::Grid id = 0;
+        for (unsigned r = 0; r < f.runs; r++) id |= (t >> f.shift[r]) & f.bits[r];
+#endif
+        uint32_t index = Board::tuple_index(id & 0xffffffull);
+        if (f.cells > 6) index += 11390625u * Board::tuple_index(id >> 24ull); // 15^6
+        return index;
     }
 
     float get_v(const Board& s) {
 
         float res = 0;
-        unsigned int id = 0;
-        auto t = s.get_tile();
-
-        id = t & 0xffffffull;
-        res += net[0][Board::pre_id[id]];
-        id = (t >> 16ull) & 0xffffffull;
-        res += net[1][Board::pre_id[id]];
-        id = ((t >> 20ull) & 0xfffull) | ((t >> 24ull) & 0xfff000ull);
-        res += net[2][Board::pre_id[id]];
-        id = ((t >> 36ull) & 0xfffull) | ((t >> 40ull) & 0xfff000ull);
-        res += net[3][Board::pre_id[id]];
-
+        uint32_t index[kMaxFeatures];
+        get_index(s, index);
+
+        size_t base = stage_base(s);
+        if (qnet.size()) {
+            for (size_t i = 0; i < features.size(); i++) res += qnet[base + features[i].table][index[i]];
+        } else {
+            for (size_t i = 0; i < features.size(); i++) res += weights()[base + features[i].table][index[i]];
+        }
         return res;
     }
 
+    /**
+     * values of the legal afterstates of an expansion, evaluated as a batch: the indices of all
+     * of them are computed and their entries prefetched before any entry is read, so that the
+     * cache misses of the lookups overlap instead of following one another
+     */
+    void get_v(const Board::Expansion& exp, float (&value)[4]) {
+        uint32_t index[4][kMaxFeatures];
+        prefetch_v(exp, index);
+        sum_v(exp, index, value);
+    }
+
+    void prefetch_v(const Board::Expansion& exp, uint32_t (&index)[4][kMaxFeatures]) const {
+        for (int op = 0; op < 4; op++) {
+            if (!(exp.legal & (1u << op))) continue;
+            get_index(exp.after[op], index[op]);
+            size_t base = stage_base(exp.after[op]);
+            for (size_t i = 0; i < features.size(); i++) {
+                if (qnet.size()) qnet[base + features[i].table].prefetch(index[op][i]);
+                else weights()[base + features[i].table].prefetch(index[op][i]);
+            }
+        }
+    }
+
+    void sum_v(const Board::Expansion& exp, const uint32_t (&index)[4][kMaxFeatures], float (&value)[4]) const {
+        for (int op = 0; op < 4; op++) {
+            if (!(exp.legal & (1u << op))) continue;
+            float res = 0;
+            size_t base = stage_base(exp.after[op]);
+            if (qnet.size()) {
+                for (size_t i = 0; i < features.size(); i++) res += qnet[base + features[i].table][index[op][i]];
+            } else {
+                for (size_t i = 0; i < features.size(); i++) res += weights()[base + features[i].table][index[op][i]];
+            }
+            value[op] = res;
+        }
+    }
+
+    /**
+     * add 'value' to the board, split evenly among the isomorphic boards sharing each table
+     */
     void update_v(const Board& s, float value) {
 
-        unsigned int id = 0;
-        auto t = s.get_tile();
+        uint32_t index[kMaxFeatures];
+        get_index(s, index);
 
-        id = t & 0xffffffull;
-        net[0][Board::pre_id[id]] += value;
-        id = (t >> 16ull) & 0xffffffull;
-        net[1][Board::pre_id[id]] += value;
-        id = ((t >> 20ull) & 0xfffull) | ((t >> 24ull) & 0xfff000ull);
-        net[2][Board::pre_id[id]] += value;
-        id = ((t >> 36ull) & 0xfffull) | ((t >> 40ull) & 0xfff000ull);
-        net[3][Board::pre_id[id]] += value;
+        size_t base = stage_base(s);
+        value /= iso;
+        for (size_t i = 0; i < features.size(); i++) weights()[base + features[i].table][index[i]] += value;
     }
 
     Board::Reward get_reward(Board::Reward before_action, Board::Reward after_action) {
         return after_action - before_action;
     }
 
-    Board::Reward compute_afterstate(Board& s, const Action::Slide& a) {
-        Board::Reward before = s.get_curr_score();
-        a.apply(s);
-        Board::Reward after = s.get_curr_score();
-        return get_reward(before, after);
-    }
-
     /**
      * Return -1 if there is no available move.
      * Otherwise return op (0, 1, 2, 3)
      */
     std::pair<int, Board::Reward> get_best_move(const Board &before) {
+        return get_best_move(before, before.expand_all());
+    }
+
+    std::pair<int, Board::Reward> get_best_move(const Board &before, const Board::Expansion& exp) {
+        float value[4];
+        get_v(exp, value);
+        return get_best_move(before, exp, value);
+    }
+
+    std::pair<int, Board::Reward> get_best_move(const Board &before, const Board::Expansion& exp, const float (&value)[4]) {
         int max_op = -1;
         float max_reward = 0;
 
         for(int op = 0; op < 4; op++) {
 
             // check if this action is valid
-            Board after(before);
-            Action::Slide a(op);
-            if (a.apply(after) == -1) continue;
+            if (!(exp.legal & (1u << op))) continue;
+            const Board& after = exp.after[op];
 
             // if valid, get the evaluation of 'before' after taking action 'a'
-            float curr_reward = get_reward(before.get_curr_score(), after.get_curr_score()) + get_v(after);
+            float curr_reward = get_reward(before.get_curr_score(), after.get_curr_score()) + value[op];
             if (max_op == -1) {
                 max_reward = curr_reward;
                 max_op = op;
@@ -397,6 +743,14 @@ public:
         update_v(s_prime, update_value);
     }
 
+    /**
+     * update the afterstates of the episode backward from the terminal one, in a single sweep
+     *
+     * the target of afterstate t is built from the already updated afterstates after it:
+     *  lambda-return: G(t) = r(t+1) + (1 - lambda) V(t+1) + lambda G(t+1), carried in one float
+     *  n-step return: G(t) = r(t+1) + ... + r(t+n) + V(t+n), the rewards kept as a running sum
+     * with G = 0 past the terminal afterstate, both are the TD(0) target r(t+1) + V(t+1) by default
+     */
     void td_training() {
 
         // terminal state
@@ -404,115 +758,430 @@ public:
         update_v(ep.back().board, update_value);
 
         // other states
-        while (ep.size() > 1) {
-            int last_id = ep.size() - 1;
-            learn_evaluation(ep[last_id - 1].board, ep[last_id].reward, ep[last_id].board);
-            ep.pop_back();
+        size_t last = ep.size() - 1;
+        float lambda_return = 0;
+        Board::Reward rewards = 0;
+        for (size_t t = last; t-- > 0; ) {
+            float target;
+            if (nstep > 1) {
+                rewards += ep[t + 1].reward;
+                if (t + 1 + nstep <= last) rewards -= ep[t + 1 + nstep].reward;
+                target = rewards + (t + nstep <= last ? get_v(ep[t + nstep].board) : 0);
+            } else {
+                target = ep[t + 1].reward + (1 - lambda) * get_v(ep[t + 1].board) + lambda * lambda_return;
+                lambda_return = target;
+            }
+            update_v(ep[t].board, learning_rate * (target - get_v(ep[t].board)));
         }
-    }
+        ep.resize(1);
 
-    void generate_tree(Node& currNode, int d) {
-        if (d == 0) return;
+        if (checkpoint) checkpoint->episode(weights());
+    }
 
-        if (d % 2 == 0) {  // max node
-            for(int i = 0; i < num_player_action; i++) {
-                Node* child = new Node();
-                currNode.children.push_back(child);
-                generate_tree(*child, d - 1);
-            }
-            return;
+    /**
+     * train on a game played before, e.g. one read from an episode log, without playing it again
+     * the afterstates and rewards are rebuilt by applying its moves from the initial board
+     */
+    void learn_episode(const std::vector<Action>& moves) {
+        ep.clear();
+        Board board;
+        for (const Action& move : moves) {
+            Board::Reward before = board.get_curr_score();
+            if (move.apply(board) == -1) break;
+            if (move.type() == Action::Slide::type) ep.push_back({board, get_reward(before, board.get_curr_score())});
         }
+        if (ep.size()) td_training();
+    }
+
+    /**
+     * Expectimax search from the root, return the best op or -1 if there is no available move.
+     * depth is the number of slides searched before the greedy evaluation at the leaves,
+     * so depth 1 looks at one slide, every placement after it, and then the best afterstate.
+     * The search recurses on the stack and keeps no per-node objects.
+     */
+    int expectminimax_search(const Board& board, int depth) {
+        for (Searcher& sr : searchers) sr.tt.new_search();
+        search_timed = false;
+        search_aborted = false;
+
+        int order[4] = {0, 1, 2, 3};
+        float values[4];
+        unsigned done;
+        return root_node(board, depth, order, values, done);
+    }
 
-        if (d % 2 == 1) {  // min node
-            for(int i = 0; i < num_evil_action; i++) {
-                Node* child = new Node();
-                currNode.children.push_back(child);
-                generate_tree(*child, d - 1);
+    /**
+     * Iterative deepening within a wall-clock budget, return the best op of the deepest iteration
+     * that completed, or -1 if there is no available move. Depth 1 always completes.
+     * Each iteration searches the root slides in the order of the values of the previous one.
+     * An iteration that runs out of time still decides the move if it finished the previous best
+     * slide, which it searches first: any other slide it finished is only chosen by beating that
+     * one at the new depth. Below the root, max nodes search first the best slide cached by the
+     * previous iteration (see max_node). A forced move, the only legal slide, is returned at once
+     * without searching.
+     */
+    int iterative_search(const Board& board, int budget_ms, int max_depth) {
+        unsigned legal = board.legal_moves();
+        if (legal == 0) return -1;
+        if (__builtin_popcount(legal) == 1) return __builtin_ctz(legal);
+
+        for (Searcher& sr : searchers) sr.tt.new_search();
+        search_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms);
+        search_aborted = false;
+
+        int order[4] = {0, 1, 2, 3};
+        float values[4];
+        unsigned done;
+        int best_op = -1;
+        for (int depth = 1; depth <= max_depth; depth++) {
+            search_timed = depth > 1;
+            int op = root_node(board, depth, order, values, done);
+            if (search_aborted) {
+                if (op != -1 && (done & (1u << order[0]))) best_op = op;
+                break;
             }
-            return;
+            if (op == -1) break;
+
+            best_op = op;
+            std::stable_sort(order, order + 4, [&](int a, int b) { return values[a] > values[b]; });
+            if (std::chrono::steady_clock::now() >= search_deadline) break;
         }
+        search_timed = false;
+        return best_op;
     }
 
-    int expectminimax_search(Node* curr_node, int d) {
- //       debug(curr_node->board);
-        if (d == 0) {  // leaf node (max node)
-            auto best_move = get_best_move(curr_node->board);
-            curr_node->value = best_move.second;
-            return best_move.first;
+    /**
+     * search the legal root slides in the given order and store the value of each one
+     * ties go to the smaller op whatever the order, so the order never changes the result
+     *
+     * if the search runs out of time, bit op of 'done' is set for each slide whose value is
+     * complete, and the best of those slides is returned
+     *
+     * with a thread pool, the max nodes below the root chance nodes are searched in parallel,
+     * each thread with its own transposition table, and the chance values are summed in the
+     * same order as chance_node() does, so the result is identical to the serial search
+     *
+     * the root slides are searched with an unbounded window, so their values are always exact
+     * and the pruning below never changes the chosen move
+     */
+    int root_node(const Board& board, int depth, const int (&order)[4], float (&values)[4], unsigned& done) {
+        if (prune) set_bounds(depth);
+        Board::Expansion exp = board.expand_all();
+        float child_value[4][12] = {};
+        done = 0;
+
+        unsigned child_done = 0; // slides whose children all completed
+        if (pool && depth > 0) {
+            Board children[4 * 12];
+            float* child_slot[4 * 12];
+            int child_op[4 * 12];
+            std::atomic<unsigned> child_failed(0);
+            size_t count = 0;
+            for (int op : order) {
+                if (!(exp.legal & (1u << op))) continue;
+                for_each_placement(exp.after[op], op, [&](const Board& next, int i) {
+                    children[count] = next;
+                    child_op[count] = op;
+                    child_slot[count++] = &child_value[op][i];
+                });
+            }
+            pool->run(count, [&](size_t i, unsigned worker) {
+                *child_slot[i] = max_node(searchers[worker], children[i], depth - 1, -infinity, infinity).value;
+                if (search_aborted) child_failed |= 1u << child_op[i];
+            });
+            child_done = ~child_failed.load();
         }
 
-        if (d % 2 == 0) {  //  max node
-            double curr_value = 0;
-            int curr_op = -1;
-
-            for(int op = 0; op < 4; op++) {
+        float leaf_value[4];
+        if (depth == 0) get_v(exp, leaf_value);
 
-                Node* next_node = curr_node->children[op];
-                next_node->board = curr_node->board;
-                next_node->last_op = op;
-                Action::Slide slide(op);
+        int max_op = -1;
+        float value = 0;
+        for (int op : order) {
+            values[op] = -std::numeric_limits<float>::infinity();
+            if (!(exp.legal & (1u << op))) continue;
+            const Board& after = exp.after[op];
+
+            float r = get_reward(board.get_curr_score(), after.get_curr_score());
+            if (depth == 0) {
+                values[op] = r + leaf_value[op];
+            } else if (pool) {
+                if (!(child_done & (1u << op))) continue;
+                float expect_value = 0;
+                int num_valid = 0;
+                for_each_placement(after, op, [&](const Board&, int i) {
+                    expect_value += child_value[op][i];
+                    num_valid++;
+                });
+                values[op] = r + (num_valid ? expect_value / num_valid : 0);
+            } else {
+                values[op] = r + chance_node(searchers[0], after, op, depth, -infinity, infinity).value;
+            }
+            if (search_aborted && !pool) break;
+            done |= 1u << op;
+            if (max_op == -1 || values[op] > value || (values[op] == value && op < max_op)) {
+                value = values[op];
+                max_op = op;
+            }
+        }
+        return max_op;
+    }
 
-                int valid = slide.apply(next_node->board);
-                if (valid == -1) continue;
+    /**
+     * value of a max node: the best reward + value over the legal slides
+     *
+     * alpha and beta bound the interesting values; a slide whose chance node fails low only
+     * proves an upper bound, so the node is exact unless every slide fails low below alpha
+     * (there is no min player, so beta stays infinite unless a caller narrows it)
+     *
+     * the best slide of the node cached at another depth is searched first, since the value it
+     * sets makes a tight alpha for the other slides; the value of the node is the maximum over
+     * the slides either way, so the order only changes how much is pruned
+     */
+    SearchValue max_node(Searcher& sr, const Board& board, int depth, double alpha, double beta) {
+        float value;
+        int hint = 0;
+        if (sr.tt.lookup(board.get_tile(), depth, node_type(board, 0), value, hint)) return {value, 0};
+        if (out_of_time(sr)) return {0, 0};
 
-                Board::Reward r = get_reward(curr_node->board.get_curr_score(), next_node->board.get_curr_score());
-                expectminimax_search(next_node, d - 1);
-                if (next_node->value + r > curr_value || curr_op == -1) {
-                    curr_value = next_node->value + r;
-                    curr_op = op;
+        Board::Expansion exp = board.expand_all();
+        int max_op = -1;
+        float bound = -std::numeric_limits<float>::infinity();
+        float leaf_value[4];
+        if (depth == 0) get_v(exp, leaf_value);
+
+        value = 0;
+        for (int k = 0; k < 4; k++) {
+            int op = k == 0 ? hint : (k <= hint ? k - 1 : k);
+            if (!(exp.legal & (1u << op))) continue;
+            const Board& after = exp.after[op];
+
+            float r = get_reward(board.get_curr_score(), after.get_curr_score());
+            if (depth == 0) {
+                float curr_value = r + leaf_value[op];
+                if (max_op == -1 || curr_value > value || (curr_value == value && op < max_op)) {
+                    value = curr_value;
+                    max_op = op;
                 }
+                continue;
+            }
+
+            double best = (max_op == -1) ? alpha : std::max<double>(alpha, value);
+            SearchValue child = chance_node(sr, after, op, depth, best - r, beta - r);
+            if (search_aborted) return {0, 0};
+            if (child.bound > 0) return {r + child.value, 1};
+            if (child.bound < 0) {
+                bound = std::max(bound, r + child.value);
+                continue;
             }
+            if (max_op == -1 || r + child.value > value || (r + child.value == value && op < max_op)) {
+                value = r + child.value;
+                max_op = op;
+            }
+            if (value >= beta) return {value, 1};
+        }
 
-            curr_node->value = curr_value;
-            return curr_op;
+        if (exp.legal && (max_op == -1 || (bound > -std::numeric_limits<float>::infinity() && value <= alpha))) {
+            return {max_op == -1 ? bound : std::max(value, bound), -1};
         }
+        sr.tt.store(board.get_tile(), depth, node_type(board, 0), value, max_op);
+        return {value, 0};
+    }
 
-        if (d % 2 == 1) {  // chance node
-            double expect_value = 0.0;
-            int num_valid = 0;
+    /**
+     * value of a chance node: the average over every tile left in the bag placed on an empty
+     * cell of the side opposite to the last slide, chance nodes are cached apart by their last slide
+     *
+     * Star1 pruning: with the children searched so far summing to S, the average can no longer
+     * exceed alpha once S plus the upper bounds of the remaining children does not, and it is
+     * at least beta once S plus their lower bounds is. The probe phase first bounds every child
+     * on its own (0 exactly for a terminal board, and a bound from its largest tile otherwise),
+     * which is tighter than one bound for the whole tree. Without a window, as at the root,
+     * the children are not probed at all. The bounds from the weight tables are loose, so few
+     * nodes are cut and the probes cost more than they save, which is why pruning is opt-in.
+     */
+    SearchValue chance_node(Searcher& sr, const Board& after, int last_op, int depth, double alpha, double beta) {
+        float value;
+        if (sr.tt.lookup(after.get_tile(), depth, node_type(after, 1 + last_op), value)) return {value, 0};
+
+        // the children are only bounded for a window to prune against
+        bool bounded = prune && (alpha > -infinity || beta < infinity);
+        Board children[12];
+        double upper[12];
+        int n = 0;
+        double upper_sum = 0;
+        for_each_placement(after, last_op, [&](const Board& next, int) {
+            children[n] = next;
+            upper[n] = !bounded || next.is_terminal() ? 0 : upper_bound(next, depth - 1);
+            upper_sum += upper[n++];
+        });
+        if (n == 0) {
+            sr.tt.store(after.get_tile(), depth, node_type(after, 1 + last_op), 0);
+            return {0, 0};
+        }
 
-            for(int tile = 1; tile <= 3; tile++) {
-                for(int pos_id = 0; pos_id < 4; pos_id++) {
+        if (bounded && upper_sum <= n * alpha) {
+            sr.probe_cuts++;
+            return {float(upper_sum / n), -1};
+        }
 
-                    Node* next_node = curr_node->children[4 * (tile - 1) + pos_id];
-                    next_node->board = curr_node->board;
-                    int pos = place_pos[curr_node->last_op][pos_id];
+        float expect_value = 0;
+        double lower_rest = double(n) * value_lower;
+        for (int i = 0; i < n; i++) {
+            upper_sum -= upper[i];
+            lower_rest -= value_lower;
+            double child_alpha = bounded ? n * alpha - expect_value - upper_sum : -infinity;
+            double child_beta = bounded ? n * beta - expect_value - lower_rest : infinity;
+
+            SearchValue child = max_node(sr, children[i], depth - 1, child_alpha, child_beta);
+            if (search_aborted) return {0, 0};
+            if (child.bound < 0) {
+                sr.star1_cuts++;
+                return {float((expect_value + child.value + upper_sum) / n), -1};
+            }
+            if (child.bound > 0) {
+                sr.star1_cuts++;
+                return {float((expect_value + child.value + lower_rest) / n), 1};
+            }
+            expect_value += child.value;
+        }
 
-                    int valid = next_node->board.place(pos, tile);
-                    if (valid == -1) continue;
+        value = expect_value / n;
+        sr.tt.store(after.get_tile(), depth, node_type(after, 1 + last_op), value);
+        return {value, 0};
+    }
 
-                    expectminimax_search(next_node, d - 1);
-                    expect_value = expect_value + next_node->value;
-                    num_valid++;
+    /**
+     * bounds on the value of a max node, from the weight tables and the largest possible rewards
+     * rewards are never negative, and a slide merges at most one pair per line, so the reward of
+     * the k-th slide from a board whose largest tile is m is at most 4 merges of two (m + k)-tiles
+     */
+    void set_bounds(int depth) {
+        if (!bounds_ready) {
+            // each stage bounds the values of its own network
+            std::vector<double> v_min(num_stage, 0), v_max(num_stage, 0);
+            auto add_range = [&](const auto& w, size_t table) {
+                float w_min = 0, w_max = 0;
+                for (size_t i = 0; i < w.size(); i++) {
+                    w_min = std::min(w_min, float(w[i]));
+                    w_max = std::max(w_max, float(w[i]));
                 }
+                v_min[table / patterns.size()] += double(w_min) * iso;
+                v_max[table / patterns.size()] += double(w_max) * iso;
+            };
+            for (size_t table = 0; table < patterns.size() * num_stage; table++) {
+                if (qnet.size()) add_range(qnet[table], table);
+                else add_range(weights()[table], table);
             }
+            value_lower = std::min(*std::min_element(v_min.begin(), v_min.end()), 0.0);
+            value_upper = std::max(*std::max_element(v_max.begin(), v_max.end()), 0.0);
+            bounds_ready = true;
+        }
 
-            curr_node->value = expect_value / num_valid;
-            return -1;
+        upper_table.assign(16 * (depth + 1), 0);
+        for (unsigned m = 0; m < 16; m++) {
+            double sum = value_upper;
+            for (int d = 0; d <= depth; d++) {
+                unsigned t = std::min(std::max(m + d, 3u), 13u);
+                sum += 4.0 * std::max<double>(3, Board::kTileScore[t + 1] - 2 * Board::kTileScore[t]);
+                upper_table[16 * d + m] = sum;
+            }
         }
     }
 
-    virtual Action take_action(const Board &board, const Action &opponent_action) {
+    double upper_bound(const Board& board, int depth) const {
+        return upper_table[16 * depth + board.max_cell()];
+    }
 
-        if (play_mode == 0) {  // training mode
-            int max_op = get_best_move(board).first;
-            if (max_op == -1) return Action();
+    /**
+     * call visit(next, i) for every placement after the last slide, in the order tile by tile
+     * and then cell by cell, where i in [0, 12) identifies the placement
+     * only the tiles left in the bag of the board are placed, each placement equally likely
+     */
+    template<typename visitor>
+    void for_each_placement(const Board& after, int last_op, visitor visit) const {
+        unsigned empty = after.empty_cells();
+        unsigned bag = after.bag();
+        for (int tile = 1; tile <= 3; tile++) {
+            if (!(bag & (1u << (tile - 1)))) continue;
+            for (int pos_id = 0; pos_id < 4; pos_id++) {
+                int pos = place_pos[last_op][pos_id];
+                if (!(empty & (1u << pos))) continue;
+
+                Board next(after);
+                next.place(pos, tile);
+                visit(next, 4 * (tile - 1) + pos_id);
+            }
+        }
+    }
 
-            Board afterstate(board);
-            Action::Slide max_action(max_op);
-            Board::Reward r = compute_afterstate(afterstate, max_action);
+    /**
+     * transposition-table type of a node: 0 for a max node or 1 + the last slide for a chance
+     * node, together with the bag, since the same grid has other values with other tiles left
+     */
+    static unsigned node_type(const Board& board, unsigned type) {
+        return (board.bag() << 3u) | type;
+    }
 
-            State state;
-            state.board = afterstate;
-            state.reward = r;
-            ep.push_back(state);
+    /**
+     * count the max nodes, check the deadline every 256 of them in a timed search, and remember
+     * once it has passed
+     * values computed after that are meaningless and must not reach the transposition table
+     */
+    bool out_of_time(Searcher& sr) {
+        if ((++sr.nodes & 0xffu) == 0 && search_timed && std::chrono::steady_clock::now() >= search_deadline) {
+            search_aborted = true;
+        }
+        return search_aborted;
+    }
 
-            return max_action;
+    /**
+     * the greedy training move split in two, so that a scheduler running many games on one thread
+     * can prefetch the weights of all of them before reading any: prepare_move() expands the board
+     * and prefetches, finish_move() reads the weights and records the move like take_action()
+     */
+    struct PendingMove {
+        Board::Expansion exp;
+        uint32_t index[4][kMaxFeatures];
+    };
+
+    void prepare_move(const Board &board, PendingMove &move) const {
+        move.exp = board.expand_all();
+        prefetch_v(move.exp, move.index);
+    }
+
+    Action finish_move(const Board &board, const PendingMove &move) {
+        float value[4];
+        sum_v(move.exp, move.index, value);
+        return record_move(board, move.exp, get_best_move(board, move.exp, value).first);
+    }
+
+    /**
+     * keep the afterstate of the chosen slide for training, return the slide or Action() if none
+     */
+    Action record_move(const Board &board, const Board::Expansion &exp, int max_op) {
+        if (max_op == -1) return Action();
+
+        State state;
+        state.board = exp.after[max_op];
+        state.reward = get_reward(board.get_curr_score(), exp.after[max_op].get_curr_score());
+        ep.push_back(state);
+
+        return Action::Slide(max_op);
+    }
+
+    virtual Action take_action(const Board &board, const Action &opponent_action) {
+
+        if (board.is_terminal()) return Action();
+
+        if (play_mode == 0) {  // training mode
+            Board::Expansion exp = board.expand_all();
+            return record_move(board, exp, get_best_move(board, exp).first);
 
         } else {  // playing mode
 
-            root.board = board;
-            int max_op = expectminimax_search(&root, tree_depth);
+            int max_op = search_budget > 0 ? iterative_search(board, search_budget, search_depth)
+                                           : expectminimax_search(board, search_depth);
             if (max_op == -1) return Action();
 
             Action::Slide max_action(max_op);
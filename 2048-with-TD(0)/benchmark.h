@@ -0,0 +1,247 @@
+#pragma once
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+
+/**
+ * micro benchmarks for the hot paths of the player
+ * use '--bench=<name>' to run one of them instead of playing games
+ *
+ * available benchmarks:
+ *  index: tuple-index lookup, the former 2^24-entry table against the split tables
+ *  moves: moves per second of the driver loop with the dummy player, and of Action::apply through
+ *         the former prototype table against the switch
+ *  eval: ns per greedy move of the TD player, evaluating its afterstates one by one or as a batch
+ */
+class Benchmark {
+public:
+	static bool run(const std::string& name) {
+		if (name == "index") index();
+		else if (name == "moves") moves();
+		else if (name == "eval") eval();
+		else return false;
+		return true;
+	}
+
+	/**
+	 * look up the tuple index of 'total' random 6-cell tuples
+	 * the legacy table is rebuilt here exactly as the former Board::precompute_index() did
+	 */
+	static void index(size_t total = 1u << 24) {
+		std::vector<uint32_t> legacy(1u << 24, 0);
+		for (uint32_t a0 = 0; a0 < 14; a0++)
+		for (uint32_t a1 = 0; a1 < 14; a1++)
+		for (uint32_t a2 = 0; a2 < 14; a2++)
+		for (uint32_t a3 = 0; a3 < 14; a3++)
+		for (uint32_t a4 = 0; a4 < 14; a4++)
+		for (uint32_t a5 = 0; a5 < 14; a5++) {
+			uint32_t res = a0 + a1 * 15 + a2 * 225 + a3 * 3375 + a4 * 50625 + a5 * 759375;
+			uint32_t id = (a5 << 20u) | (a4 << 16u) | (a3 << 12u) | (a2 << 8u) | (a1 << 4u) | a0;
+			legacy[id] = res;
+		}
+
+		std::vector<uint32_t> ids = random_tuples(total);
+		size_t mismatch = 0;
+		for (uint32_t id : ids) mismatch += (legacy[id] != Board::tuple_index(id));
+
+		uint64_t sum_legacy = 0, sum_split = 0;
+		double ns_legacy = measure([&]() { for (uint32_t id : ids) sum_legacy += legacy[id]; }) / ids.size();
+		double ns_split = measure([&]() { for (uint32_t id : ids) sum_split += Board::tuple_index(id); }) / ids.size();
+
+		std::cout << std::fixed << std::setprecision(3);
+		std::cout << "index: legacy table " << ns_legacy << " ns/lookup (" << (legacy.size() * sizeof(uint32_t) >> 20) << " MB)" << std::endl;
+		std::cout << "index: split tables " << ns_split << " ns/lookup (" << ((sizeof(Board::pre_index_lo) + sizeof(Board::pre_index_hi)) >> 10) << " KB)" << std::endl;
+		std::cout << "index: " << mismatch << " mismatches, checksum " << (sum_legacy == sum_split ? "ok" : "differs") << std::endl;
+	}
+
+	/**
+	 * play 'total' games of the dummy player against the random environment
+	 * each move goes through Agent::take_action and Episode::apply_action as in the driver
+	 * the moves of these games are then applied again on their own, once through the former
+	 * prototype-table dispatch of Action::apply (see LegacyAction) and once through the switch
+	 */
+	static void moves(size_t total = 20000) {
+		Player play("seed=0");
+		RandomEnv evil;
+		size_t ops = 0;
+		std::vector<Board> before;
+		std::vector<Action> actions;
+		auto games = [&](bool record) {
+			ops = 0;
+			for (size_t i = 0; i < total; i++) {
+				Episode game;
+				while (true) {
+					Agent& who = game.take_turns(play, evil);
+					Action move = who.take_action(game.state(), game.last_action());
+					if (record) {
+						before.push_back(game.state());
+						actions.push_back(move);
+					}
+					if (!game.apply_action(move)) break;
+				}
+				ops += game.step();
+				evil.close_episode();
+			}
+		};
+		double ns = measure([&]() { games(false); });
+		games(true);
+
+		long long sum_legacy = 0, sum_switch = 0;
+		double ns_legacy = measure([&]() {
+			sum_legacy = 0;
+			for (size_t i = 0; i < actions.size(); i++) {
+				Board b = before[i];
+				LegacyAction move(actions[i]); // a copy, as Episode::apply_action takes one
+				sum_legacy += move.apply_legacy(b);
+			}
+		});
+		double ns_switch = measure([&]() {
+			sum_switch = 0;
+			for (size_t i = 0; i < actions.size(); i++) {
+				Board b = before[i];
+				sum_switch += actions[i].apply(b);
+			}
+		});
+
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << "moves: " << total << " games, " << ops << " moves, " << (ops * 1e9 / ns) << " moves/s" << std::endl;
+		std::cout << "moves: prototype table " << (actions.size() * 1e9 / ns_legacy) << " applies/s" << std::endl;
+		std::cout << "moves: switch " << (actions.size() * 1e9 / ns_switch) << " applies/s" << std::endl;
+		std::cout << "moves: rewards " << (sum_legacy == sum_switch ? "match" : "differ") << std::endl;
+	}
+
+	/**
+	 * pick the greedy move of 'total' positions taken from games of the dummy player, with random
+	 * weights, once evaluating the afterstates one at a time as get_best_move() formerly did, and
+	 * once through get_best_move(), which evaluates them as one prefetched batch
+	 */
+	static void eval(size_t total = 1u << 20) {
+		TDPlayer td("mode=train");
+		std::default_random_engine engine(0);
+		std::uniform_real_distribution<float> value(-1, 1);
+		for (weight& w : td.weights()) {
+			for (size_t i = 0; i < w.size(); i++) w[i] = value(engine);
+		}
+
+		std::vector<Board> positions;
+		Player play("seed=0");
+		RandomEnv evil("seed=0");
+		while (positions.size() < total) {
+			Episode game;
+			while (true) {
+				Agent& who = game.take_turns(play, evil);
+				if (&who == &play) positions.push_back(game.state());
+				Action move = who.take_action(game.state(), game.last_action());
+				if (!game.apply_action(move)) break;
+			}
+		}
+		positions.resize(total);
+
+		std::vector<int> serial_op(total), batch_op(total);
+		double ns_serial = measure([&]() {
+			for (size_t i = 0; i < total; i++) {
+				const Board& before = positions[i];
+				Board::Expansion exp = before.expand_all();
+				int max_op = -1;
+				float max_value = 0;
+				for (int op = 0; op < 4; op++) {
+					if (!(exp.legal & (1u << op))) continue;
+					float v = td.get_reward(before.get_curr_score(), exp.after[op].get_curr_score()) + td.get_v(exp.after[op]);
+					if (max_op == -1 || max_value < v) {
+						max_value = v;
+						max_op = op;
+					}
+				}
+				serial_op[i] = max_op;
+			}
+		}) / total;
+		double ns_batch = measure([&]() {
+			for (size_t i = 0; i < total; i++) batch_op[i] = td.get_best_move(positions[i]).first;
+		}) / total;
+
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << "eval: one by one " << ns_serial << " ns/move" << std::endl;
+		std::cout << "eval: batched " << ns_batch << " ns/move" << std::endl;
+		std::cout << "eval: " << (serial_op != batch_op ? "moves differ" : "same moves") << std::endl;
+	}
+
+protected:
+	/**
+	 * the former Action::apply, rebuilt here as it was: look up the prototype of the action type
+	 * in a hash map, construct an action of that type in place over this one, and make a
+	 * virtual call to its apply()
+	 */
+	class LegacyAction : public Action {
+	public:
+		LegacyAction(const Action& a = {}) : Action(a) {}
+		virtual Board::Reward apply_legacy(Board& b) const {
+			auto proto = prototypes().find(type());
+			if (proto != prototypes().end()) return proto->second->rebuild(this).apply_legacy(b);
+			return -1;
+		}
+
+	protected:
+		class Slide;
+		class Place;
+		static std::unordered_map<unsigned, LegacyAction*>& prototypes();
+		virtual LegacyAction& rebuild(const LegacyAction* a) const { return *new (const_cast<LegacyAction*>(a)) LegacyAction(*a); }
+	};
+
+	/**
+	 * packed 6-cell tuples with tiles up to 3072, the range covered by the legacy table
+	 */
+	static std::vector<uint32_t> random_tuples(size_t total, unsigned seed = 0) {
+		std::default_random_engine engine(seed);
+		std::geometric_distribution<uint32_t> tile(0.3);
+		std::vector<uint32_t> ids(total);
+		for (uint32_t& id : ids) {
+			id = 0;
+			for (int c = 0; c < 6; c++) id |= std::min(tile(engine), 13u) << (c << 2u);
+		}
+		return ids;
+	}
+
+	/**
+	 * run the job once to warm up, then return the time of a second run in nanoseconds
+	 */
+	template<typename job>
+	static double measure(job run) {
+		run();
+		auto start = std::chrono::steady_clock::now();
+		run();
+		auto stop = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(stop - start).count();
+	}
+};
+
+class Benchmark::LegacyAction::Slide : public Benchmark::LegacyAction {
+public:
+	Slide(const Action& a = {}) : LegacyAction(a) {}
+	Board::Reward apply_legacy(Board& b) const override { return b.slide(event()); }
+protected:
+	LegacyAction& rebuild(const LegacyAction* a) const override { return *new (const_cast<LegacyAction*>(a)) Slide(*a); }
+};
+
+class Benchmark::LegacyAction::Place : public Benchmark::LegacyAction {
+public:
+	Place(const Action& a = {}) : LegacyAction(a) {}
+	Board::Reward apply_legacy(Board& b) const override { return b.place(event() & 0x0f, event() >> 4); }
+protected:
+	LegacyAction& rebuild(const LegacyAction* a) const override { return *new (const_cast<LegacyAction*>(a)) Place(*a); }
+};
+
+inline std::unordered_map<unsigned, Benchmark::LegacyAction*>& Benchmark::LegacyAction::prototypes() {
+	static std::unordered_map<unsigned, LegacyAction*> m = {
+		{ unsigned(Action::Slide::type), new Slide },
+		{ unsigned(Action::Place::type), new Place },
+	};
+	return m;
+}
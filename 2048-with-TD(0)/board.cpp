@@ -1,17 +1,131 @@
+#include <algorithm>
 #include <iostream>
 #include "board.h"
 
 #define debug(a) std::cout << #a << " = " << a << std::endl
 #define print(a) std::cout << a << std::endl
 
-const Board::Reward Board::kTileScore[15] = {0, 0, 0, 3, 9, 27, 81, 243, 729, 2187, 6561, 19683, 59049, 177147, 531441};
-const Board::Cell Board::kTileValue[15] = {0, 1, 2, 3, 6, 12, 24, 48, 96, 192, 384, 768, 1536, 3072, 6144};
-unsigned int Board::pre_left[66000];
-unsigned int Board::pre_score[66000];
-unsigned int Board::pre_id[33554431];
+constexpr Board::Reward Board::kTileScore[15];
+constexpr Board::Cell Board::kTileValue[15];
+
+namespace {
+
+/**
+ * slide a line toward its first cell (the lowest nibble)
+ */
+constexpr void slide_line(unsigned int (&line)[4]) {
+    for (int c = 0; c < 3; c++) {
+        if (Board::can_merge(line[c], line[c + 1])) {
+            Board::Cell new_tile = std::max(line[c], line[c + 1]) + 1;
+            line[c] = new_tile;  line[c + 1] = 0;
+        }
+        if (line[c] == 0) {  // can slide
+            line[c] = line[c + 1];
+            line[c + 1] = 0;
+        }
+    }
+}
+
+/**
+ * mirror the cells of a packed row
+ */
+constexpr unsigned int reverse_row(unsigned int row) {
+    return ((row & 0x000fu) << 12u) | ((row & 0x00f0u) << 4u) | ((row & 0x0f00u) >> 4u) | ((row & 0xf000u) >> 12u);
+}
+
+/**
+ * slide result of every row toward its first cell
+ */
+constexpr LookupTable<uint16_t, 65536> make_left_table() {
+    LookupTable<uint16_t, 65536> table{};
+    for (unsigned int from = 0; from < 65536; from++) {
+        unsigned int line[4] = {from & 0x0fu, (from >> 4u) & 0x0fu, (from >> 8u) & 0x0fu, from >> 12u};
+        slide_line(line);
+        table.value[from] = line[0] | (line[1] << 4u) | (line[2] << 8u) | (line[3] << 12u);
+    }
+    return table;
+}
+
+/**
+ * slide result of every row toward its last cell, i.e. the mirrored left slide
+ */
+constexpr LookupTable<uint16_t, 65536> make_right_table(const LookupTable<uint16_t, 65536>& left) {
+    LookupTable<uint16_t, 65536> table{};
+    for (unsigned int from = 0; from < 65536; from++) {
+        table.value[from] = reverse_row(left[reverse_row(from)]);
+    }
+    return table;
+}
+
+/**
+ * row results spread to the column layout of a Grid
+ */
+constexpr LookupTable<Board::Grid, 65536> make_col_table(const LookupTable<uint16_t, 65536>& row) {
+    LookupTable<Board::Grid, 65536> table{};
+    for (unsigned int from = 0; from < 65536; from++) {
+        Board::Grid to = row[from];
+        table.value[from] = (to & 0x000full) | ((to & 0x00f0ull) << 12u) | ((to & 0x0f00ull) << 24u) | ((to & 0xf000ull) << 36u);
+    }
+    return table;
+}
+
+/**
+ * total tile score of every row result
+ */
+constexpr LookupTable<uint32_t, 65536> make_score_table(const LookupTable<uint16_t, 65536>& row) {
+    LookupTable<uint32_t, 65536> table{};
+    for (unsigned int from = 0; from < 65536; from++) {
+        unsigned int to = row[from];
+        table.value[from] = Board::kTileScore[std::min(to & 0x0fu, 14u)] + Board::kTileScore[std::min((to >> 4u) & 0x0fu, 14u)]
+                          + Board::kTileScore[std::min((to >> 8u) & 0x0fu, 14u)] + Board::kTileScore[std::min(to >> 12u, 14u)];
+    }
+    return table;
+}
+
+/**
+ * whether every row can slide toward its first cell (bit 0) or its last cell (bit 1)
+ */
+constexpr LookupTable<uint8_t, 65536> make_move_table(const LookupTable<uint16_t, 65536>& left, const LookupTable<uint16_t, 65536>& right) {
+    LookupTable<uint8_t, 65536> table{};
+    for (unsigned int from = 0; from < 65536; from++) {
+        table.value[from] = (left[from] != from ? 1u : 0u) | (right[from] != from ? 2u : 0u);
+    }
+    return table;
+}
+
+/**
+ * base-15 value of every 3-cell group, multiplied by the given place value
+ */
+constexpr LookupTable<uint32_t, 4096> make_index_table(uint32_t scale) {
+    LookupTable<uint32_t, 4096> table{};
+    for (uint32_t id = 0; id < 4096; id++) {
+        uint32_t res = 0, base = 1;
+        for (uint32_t c = 0; c < 3; c++) {
+            res += std::min((id >> (c << 2u)) & 0x0fu, 14u) * base;
+            base *= 15;
+        }
+        table.value[id] = res * scale;
+    }
+    return table;
+}
+
+}
+
+constexpr LookupTable<uint16_t, 65536> Board::pre_left = make_left_table();
+constexpr LookupTable<uint16_t, 65536> Board::pre_right = make_right_table(Board::pre_left);
+constexpr LookupTable<Board::Grid, 65536> Board::pre_up = make_col_table(Board::pre_left);
+constexpr LookupTable<Board::Grid, 65536> Board::pre_down = make_col_table(Board::pre_right);
+constexpr LookupTable<uint32_t, 65536> Board::pre_score_left = make_score_table(Board::pre_left);
+constexpr LookupTable<uint32_t, 65536> Board::pre_score_right = make_score_table(Board::pre_right);
+constexpr LookupTable<uint8_t, 65536> Board::pre_move = make_move_table(Board::pre_left, Board::pre_right);
+constexpr LookupTable<uint32_t, 4096> Board::pre_index_lo = make_index_table(1);
+constexpr LookupTable<uint32_t, 4096> Board::pre_index_hi = make_index_table(3375);
 
 /**
  * place a tile (index value) to the specific position (1-d form index)
+ * the tile is also taken from the bag (see bag()), so a valid place() changes attr as well as
+ * the cell: the environment draws its next tile from the bag the board carries, and episodes,
+ * searches and replays all depend on placing through here to keep that bag right
  * return 0 if the action is valid, or -1 if not
  */
 Board::Reward Board::place(unsigned pos, Board::Cell tile_id) {
@@ -20,6 +134,8 @@ Board::Reward Board::place(unsigned pos, Board::Cell tile_id) {
     if (tile_id != 1 && tile_id != 2 && tile_id != 3) return -1;
     set_cell(pos, tile_id);
     board_score += kTileScore[tile_id];
+    attr |= Data(1) << (tile_id - 1);
+    if ((attr & 0x7u) == 0x7u) attr &= ~Data(0x7u);
     return 0;
 }
 
@@ -42,48 +158,132 @@ Board::Reward Board::get_curr_score() const {
 }
 
 Board::Reward Board::slide_left() {
+    Grid prev = tile;
+    Grid next = 0;
+    board_score = 0;
 
-//    debug(*this);
+    for (unsigned long long i = 0; i < 4; i++) {
+        Row row = get_row(i);
+        next |= Grid(pre_left[row]) << (i << 4ull);
+        board_score += pre_score_left[row];
+    }
+    tile = next;
+
+    return (tile != prev) ? board_score : -1;
+}
 
-    Board prev = *this;
+Board::Reward Board::slide_right() {
+    Grid prev = tile;
+    Grid next = 0;
     board_score = 0;
 
-    for(int i = 0; i < 4; i++) {
+    for (unsigned long long i = 0; i < 4; i++) {
         Row row = get_row(i);
-        row = ((row & 0xf000ull) >> 12ull) | ((row & 0x0f00ull) >> 4ull) |
-                ((row & 0x00f0ull) << 4ull) | ((row & 0x000full) << 12ull);
+        next |= Grid(pre_right[row]) << (i << 4ull);
+        board_score += pre_score_right[row];
+    }
+    tile = next;
 
-        Row new_row = pre_left[row];
-        board_score += pre_score[new_row];
+    return (tile != prev) ? board_score : -1;
+}
 
-        new_row = ((new_row & 0xf000ull) >> 12ull) | ((new_row & 0x0f00ull) >> 4ull) |
-                  ((new_row & 0x00f0ull) << 4ull) | ((new_row & 0x000full) << 12ull);
-        set_row(i, new_row);
+Board::Reward Board::slide_up() {
+    Grid prev = tile;
+    Grid next = 0;
+    board_score = 0;
+
+    for (unsigned long long i = 0; i < 4; i++) {
+        Row col = get_col(i);
+        next |= pre_up[col] << (i << 2ull);
+        board_score += pre_score_left[col];
     }
+    tile = next;
 
-//    debug(*this);
+    return (tile != prev) ? board_score : -1;
+}
 
-    return (*this != prev) ? board_score : -1;
+Board::Reward Board::slide_down() {
+    Grid prev = tile;
+    Grid next = 0;
+    board_score = 0;
+
+    for (unsigned long long i = 0; i < 4; i++) {
+        Row col = get_col(i);
+        next |= pre_down[col] << (i << 2ull);
+        board_score += pre_score_right[col];
+    }
+    tile = next;
+
+    return (tile != prev) ? board_score : -1;
 }
 
-Board::Reward Board::slide_right() {
-    reflect_horizontal();
-    Reward slide_score = slide_left();
-    reflect_horizontal();
-    return slide_score;
+/**
+ * slide the board in all four directions at once
+ * every row and column is read only once and shared by the two opposite slides
+ */
+Board::Expansion Board::expand_all() const {
+    Grid next[4] = {};
+    Reward score[4] = {};
+
+    for (unsigned long long i = 0; i < 4; i++) {
+        Row row = get_row(i);
+        next[1] |= Grid(pre_right[row]) << (i << 4ull);
+        next[3] |= Grid(pre_left[row]) << (i << 4ull);
+        score[1] += pre_score_right[row];
+        score[3] += pre_score_left[row];
+
+        Row col = get_col(i);
+        next[0] |= pre_up[col] << (i << 2ull);
+        next[2] |= pre_down[col] << (i << 2ull);
+        score[0] += pre_score_left[col];
+        score[2] += pre_score_right[col];
+    }
+
+    Expansion exp;
+    exp.legal = 0;
+    for (unsigned op = 0; op < 4; op++) {
+        exp.after[op] = Board(next[op], attr);
+        exp.after[op].board_score = score[op];
+        exp.reward[op] = (next[op] != tile) ? score[op] : -1;
+        exp.legal |= unsigned(next[op] != tile) << op;
+    }
+    return exp;
 }
-Board::Reward Board::slide_up() {
-    transpose();
-    Reward slide_score = slide_left();
-    transpose();
-    return slide_score;
+
+/**
+ * bitmask of the legal opcodes, bit op is set if slide(op) would change the board
+ */
+unsigned Board::legal_moves() const {
+    unsigned row = 0, col = 0;
+    for (unsigned long long i = 0; i < 4; i++) {
+        row |= pre_move[get_row(i)];
+        col |= pre_move[get_col(i)];
+    }
+    return (col & 1u) | (row & 2u) | ((col & 2u) << 1u) | ((row & 1u) << 3u);
 }
 
-Board::Reward Board::slide_down() {
-    rotate_right();
-    Reward slide_score = slide_left();
-    rotate_left();
-    return slide_score;
+/**
+ * bitmask of the empty cells, bit i is set if cell i is empty
+ */
+unsigned Board::empty_cells() const {
+    Grid t = tile;
+    t |= t >> 2ull;
+    t |= t >> 1ull;
+    t = ~t & 0x1111111111111111ull;
+    t = (t | (t >> 3ull)) & 0x0303030303030303ull;
+    t = (t | (t >> 6ull)) & 0x000f000f000f000full;
+    t = (t | (t >> 12ull)) & 0x000000ff000000ffull;
+    t = (t | (t >> 24ull)) & 0x000000000000ffffull;
+    return unsigned(t);
+}
+
+/**
+ * the largest tile (index value) on the board
+ */
+Board::Cell Board::max_cell() const {
+    Cell max = 0;
+    for (Grid t = tile; t; t >>= 4ull) max = std::max(max, Cell(t & 0x0full));
+    return max;
 }
 
 void Board::transpose() {
@@ -136,13 +336,6 @@ std::ostream& operator <<(std::ostream& out, const Board& b) {
     return out;
 }
 
-bool Board::can_merge(Board::Cell cell01, Board::Cell cell02) {
-    if (cell01 == 1 && cell02 == 2) return true;
-    if (cell01 == 2 && cell02 == 1) return true;
-    return cell01 > 2 && cell02 > 2 && cell01 == cell02;
-
-}
-
 Board::Cell Board::get_cell(unsigned long long i) const {
     return (tile >> (i << 2ull)) & 0x0full;
 }
@@ -159,57 +352,12 @@ void Board::set_row(unsigned long long i, Board::Row value) {
     tile = (tile & ~(0xffffull << (i << 4ull))) | (uint64_t(value & 0xffffull) << (i << 4ull));
 }
 
-void Board::precompute_left() {
-
-    for(unsigned int a0 = 0; a0 < 15; a0++) {
-        for(unsigned int a1 = 0; a1 < 15; a1++) {
-            for(unsigned int a2 = 0; a2 < 15; a2++) {
-                for(unsigned int a3 = 0; a3 < 15; a3++) {
-
-                    unsigned int row[4] = {a0, a1, a2, a3};
-                    unsigned long long from = row[3] + (row[2] << 4ull) + (row[1] << 8ull) + (row[0] << 12ull);
-
-                    for (int c = 0; c < 3; c++) {
-                        if (Board::can_merge(row[c], row[c + 1])) {
-                            Cell new_tile = std::max(row[c], row[c + 1]) + 1;
-                            row[c] = new_tile;  row[c + 1] = 0;
-                        }
-                        if (row[c] == 0) {  // can slide
-                            row[c] = row[c + 1];
-                            row[c + 1] = 0;
-                        }
-                    }
-                    long long score = 0;
-                    for (unsigned int cell : row) score += Board::kTileScore[cell];
-
-                    unsigned long long to = row[3] + (row[2] << 4ull) + (row[1] << 8ull) + (row[0] << 12ull);
-                    Board::pre_left[from] = to;
-                    Board::pre_score[to] = score;
-                }
-            }
-        }
-    }
-}
-
-void Board::precompute_index() {
-
-    unsigned int b0 = 1, b1 = 15, b2 = 225, b3 = 3375, b4 = 50625, b5 = 759375;
-    for(unsigned int a0 = 0; a0 < 14; a0++) {
-        for (unsigned int a1 = 0; a1 < 14; a1++) {
-            for (unsigned int a2 = 0; a2 < 14; a2++) {
-                for (unsigned int a3 = 0; a3 < 14; a3++) {
-                    for (unsigned int a4 = 0; a4 < 14; a4++) {
-                        for (unsigned int a5 = 0; a5 < 14; a5++) {
-
-                            unsigned int res = a0 * b0 + a1 * b1 + a2 * b2 + a3 * b3 + a4 * b4 + a5 * b5;
-                            unsigned int id = (a5 << 20u) | (a4 << 16u) | (a3 << 12u) | (a2 << 8u) | (a1 << 4u) | a0;
-                            pre_id[id] = res;
-                        }
-                    }
-                }
-            }
-        }
-    }
+/**
+ * pack the i-th column into a line, with the top cell at the lowest nibble
+ */
+Board::Row Board::get_col(unsigned long long i) const {
+    Grid col = (tile >> (i << 2ull)) & 0x000f000f000f000full;
+    return (col | (col >> 12ull) | (col >> 24ull) | (col >> 36ull)) & 0xffffull;
 }
 
 Board::Grid Board::get_tile() const {
@@ -7,6 +7,8 @@
 
 #pragma once
 #include <array>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <iomanip>
 #include <map>
@@ -22,6 +24,14 @@
  *
  */
 
+/**
+ * fixed-size lookup table that can be filled in a constant expression
+ */
+template<typename T, size_t N>
+struct LookupTable {
+    T value[N];
+    constexpr const T& operator[](size_t i) const { return value[i]; }
+};
 
 class Board {
 public:
@@ -42,20 +52,46 @@ public:
 
     Row get_row(unsigned long long i) const;
     void set_row(unsigned long long i, Row value);
+    Row get_col(unsigned long long i) const;
     Cell get_cell(unsigned long long i) const;
     void set_cell(unsigned long long i, Cell value);
 
     Data info() const { return attr; }
     Data info(Data dat) { Data old = attr; attr = dat; return old; }
 
-    static const Cell kTileValue[15];
-    static const Reward kTileScore[15];
-    static unsigned int pre_left[66000];
-    static unsigned int pre_score[66000];
-    static unsigned int pre_id[33554431];
-
-    static void precompute_left();
-    static void precompute_index();
+    /**
+     * tiles still in the bag of the environment, bit t - 1 is set if tile t can be drawn next
+     * the lowest 3 bits of attr record the tiles drawn from the current bag (0 for a full bag),
+     * place() draws from the bag and refills it once all three tiles are drawn
+     */
+    unsigned bag() const { return ~unsigned(attr) & 0x7u; }
+
+    static constexpr Cell kTileValue[15] = {0, 1, 2, 3, 6, 12, 24, 48, 96, 192, 384, 768, 1536, 3072, 6144};
+    static constexpr Reward kTileScore[15] = {0, 0, 0, 3, 9, 27, 81, 243, 729, 2187, 6561, 19683, 59049, 177147, 531441};
+
+    /**
+     * slide tables indexed by a packed line (cell 0 at the lowest nibble)
+     * rows are looked up in pre_left/pre_right, columns in pre_up/pre_down,
+     * which already spread the result to the column layout of a Grid
+     * pre_score_* hold the total tile score of the line after sliding
+     * pre_move has bit 0 set if the line can slide toward its first cell, bit 1 toward its last
+     * all tables are generated at compile time (see board.cpp)
+     */
+    static const LookupTable<uint16_t, 65536> pre_left;
+    static const LookupTable<uint16_t, 65536> pre_right;
+    static const LookupTable<Grid, 65536> pre_up;
+    static const LookupTable<Grid, 65536> pre_down;
+    static const LookupTable<uint32_t, 65536> pre_score_left;
+    static const LookupTable<uint32_t, 65536> pre_score_right;
+    static const LookupTable<uint8_t, 65536> pre_move;
+
+    /**
+     * base-15 index of a packed 6-cell tuple (first cell at the lowest nibble)
+     * the 24-bit tuple is split into two 12-bit halves, each looked up separately
+     */
+    static const LookupTable<uint32_t, 4096> pre_index_lo;
+    static const LookupTable<uint32_t, 4096> pre_index_hi;
+    static uint32_t tuple_index(uint32_t id) { return pre_index_lo[id & 0xfffu] + pre_index_hi[(id >> 12u) & 0xfffu]; }
 
 public:
     bool operator ==(const Board& b) const { return tile == b.tile; }
@@ -66,7 +102,11 @@ public:
     bool operator >=(const Board& b) const { return !(*this < b); }
 
 public:
-    static bool can_merge(Cell cell01, Cell cell02);
+    static constexpr bool can_merge(Cell cell01, Cell cell02) {
+        if (cell01 == 1 && cell02 == 2) return true;
+        if (cell01 == 2 && cell02 == 1) return true;
+        return cell01 > 2 && cell02 > 2 && cell01 == cell02;
+    }
     Board::Reward get_curr_score() const;
     Grid get_tile() const;
 
@@ -77,6 +117,14 @@ public:
     Reward slide_up();
     Reward slide_down();
 
+    struct Expansion;
+    Expansion expand_all() const;
+
+    unsigned legal_moves() const;
+    bool is_terminal() const { return legal_moves() == 0; }
+    unsigned empty_cells() const;
+    Cell max_cell() const;
+
     void transpose();
     void reflect_horizontal();
     void reflect_vertical();
@@ -93,5 +141,16 @@ private:
     Data attr;
 };
 
+/**
+ * all four slides of a board, computed in one pass by Board::expand_all()
+ * entries are indexed by opcode (0: up, 1: right, 2: down, 3: left)
+ * reward[op] is what slide(op) returns, and bit op of legal is set if the slide is legal
+ */
+struct Board::Expansion {
+    Board after[4];
+    Reward reward[4];
+    unsigned legal;
+};
+
 
 #endif //PROJECT02_BOARD_H
@@ -0,0 +1,154 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * bounded lock-free queue for any number of producers and consumers
+ *
+ * every cell carries a sequence number that tells whether it is ready to be written for the
+ * current lap (sequence == position) or ready to be read (sequence == position + 1), so both
+ * push() and pop() only race on one counter and never block; they fail instead when the queue
+ * is full or empty
+ *
+ * push_wait() and pop_wait() retry a few times and then sleep until the other side makes room
+ * or adds an item, so a thread kept waiting does not burn a core; push() and pop() only take
+ * the lock to wake them when some thread is asleep
+ */
+template<typename T>
+class BoundedQueue {
+public:
+	/**
+	 * the capacity is rounded up to a power of two
+	 */
+	BoundedQueue(size_t capacity) : cells(round_up(capacity)), mask(cells.size() - 1), head(0), tail(0), sleepers(0), epoch(0) {
+		for (size_t i = 0; i < cells.size(); i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator =(const BoundedQueue&) = delete;
+
+	/**
+	 * move the item into the queue, or leave it untouched and return false if the queue is full
+	 */
+	bool push(T&& item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		cell->item = std::move(item);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		wake();
+		return true;
+	}
+
+	/**
+	 * move the oldest item out of the queue, or return false if the queue is empty
+	 */
+	bool pop(T& item) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		item = std::move(cell->item);
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		wake();
+		return true;
+	}
+
+	/**
+	 * move the item into the queue, waiting while the queue is full
+	 */
+	void push_wait(T&& item) {
+		wait([&]() { return push(std::move(item)); });
+	}
+
+	/**
+	 * move the oldest item out of the queue, waiting while the queue is empty
+	 */
+	void pop_wait(T& item) {
+		wait([&]() { return pop(item); });
+	}
+
+	size_t capacity() const { return cells.size(); }
+
+protected:
+	/**
+	 * retry 'done' until it succeeds, sleeping between the retries after the first few
+	 * a sleeper is counted before it reads the epoch and retries, and push() and pop() check
+	 * the count after their change, so either the retry sees the change or the epoch moves on
+	 */
+	template<typename attempt>
+	void wait(attempt done) {
+		for (unsigned spin = 0; spin < kSpins; spin++) {
+			if (done()) return;
+		}
+		while (true) {
+			sleepers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			unsigned seen = epoch.load();
+			bool ok = done();
+			if (!ok) {
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return epoch.load() != seen; });
+			}
+			sleepers.fetch_sub(1);
+			if (ok) return;
+		}
+	}
+
+	void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) == 0) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		epoch.fetch_add(1);
+		changed.notify_all();
+	}
+
+	static constexpr unsigned kSpins = 64;
+
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	static size_t round_up(size_t n) {
+		size_t size = 1;
+		while (size < n) size <<= 1;
+		return size;
+	}
+
+private:
+	std::vector<Cell> cells;
+	const size_t mask;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	alignas(64) std::atomic<unsigned> sleepers;
+	std::atomic<unsigned> epoch;
+	std::mutex mutex;
+	std::condition_variable changed;
+};
@@ -0,0 +1,124 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "weight.h"
+
+/**
+ * periodic weight checkpoints written in the background
+ *
+ * every 'every' trained episodes, the thread that finishes the episode copies the tables into
+ * one of two buffers and hands it to a writer thread, which saves it as a weight file (see
+ * weight_file::save, which replaces the file atomically); the training threads only pay for
+ * the copy and never wait for the disk
+ *
+ * while one buffer is being written the other one can be filled, and a checkpoint that comes
+ * due while both are in use is skipped rather than waited for
+ */
+class Checkpoint {
+public:
+	Checkpoint(const std::string& path, size_t every, const std::string& layout)
+		: path(path), layout(layout), every(every ? every : 1), count(0), written(0), skipped(0),
+		  writing(-1), pending(-1), filling(-1), stop(false) {
+		writer = std::thread(&Checkpoint::work, this);
+	}
+
+	/**
+	 * finish the checkpoint in progress and the one waiting, if any, then stop the writer
+	 */
+	~Checkpoint() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		writer.join();
+	}
+
+	Checkpoint(const Checkpoint&) = delete;
+	Checkpoint& operator =(const Checkpoint&) = delete;
+
+	/**
+	 * count one trained episode, and snapshot 'net' for the writer if a checkpoint is due
+	 * safe to call from several training threads
+	 */
+	void episode(const std::vector<weight>& net) {
+		if (++count % every != 0) return;
+
+		int buffer;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (pending != -1 || filling != -1) {
+				skipped++;
+				return;
+			}
+			buffer = filling = (writing == 0) ? 1 : 0;
+		}
+		snapshot[buffer] = net;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending = buffer;
+			filling = -1;
+		}
+		wake.notify_all();
+	}
+
+	/**
+	 * wait until the snapshots handed to the writer are written, e.g. at the end of training
+	 */
+	void flush() {
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [&]() { return writing == -1 && pending == -1 && filling == -1; });
+	}
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const Checkpoint& cp) {
+		return out << "checkpoint: " << cp.written << " written, " << cp.skipped << " skipped, to '" << cp.path << "'";
+	}
+
+protected:
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&]() { return stop || pending != -1; });
+			if (pending == -1) return;
+			writing = pending;
+			pending = -1;
+			lock.unlock();
+
+			try {
+				weight_file::save(path, snapshot[writing], layout);
+				written++;
+			} catch (const std::exception& e) {
+				std::cerr << e.what() << std::endl;
+			}
+
+			lock.lock();
+			writing = -1;
+			idle.notify_all();
+		}
+	}
+
+private:
+	std::string path;
+	std::string layout;
+	size_t every;
+	std::atomic<size_t> count;
+	std::atomic<size_t> written;
+	std::atomic<size_t> skipped;
+
+	std::vector<weight> snapshot[2];
+	int writing;
+	int pending;
+	int filling;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	bool stop;
+	std::thread writer;
+};
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <mutex>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
@@ -19,6 +20,8 @@ public:
 	 * the limit of saving records
 	 *
 	 * note that total >= limit >= block
+	 * a run of unknown length, e.g. a replay of episode logs, passes kOpenEnded as the total
+	 * and calls finish() at its end
 	 */
 	Statistics(size_t total, size_t block = 0, size_t limit = 0)
 		: total(total),
@@ -104,6 +107,18 @@ public:
 		const_cast<Statistics&>(*this).block = block_temp;
 	}
 
+	/**
+	 * end a run at the episodes counted so far, and show them all when no block size was given
+	 */
+	void finish() {
+		std::lock_guard<std::mutex> lock(mutex);
+		total = count;
+		if (block > count && count) {
+			block = count;
+			show();
+		}
+	}
+
 	bool is_finished() const {
 		return count >= total;
 	}
@@ -119,6 +134,25 @@ public:
 		if (count % block == 0) show();
 	}
 
+	/**
+	 * the number of episodes still to run
+	 */
+	size_t remaining() const {
+		return total > count ? total - count : 0;
+	}
+
+	/**
+	 * append an episode played elsewhere, which is then counted and shown as if it were
+	 * played through open_episode() and close_episode()
+	 * safe to call from several threads, e.g. the workers of the multi-threaded trainer
+	 */
+	void merge(Episode&& ep) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (count++ >= limit) data.pop_front();
+		data.push_back(std::move(ep));
+		if (count % block == 0) show();
+	}
+
 	Episode& at(size_t i) {
 		auto it = data.begin();
 		while (i--) it++;
@@ -145,10 +179,14 @@ public:
 		return in;
 	}
 
+public:
+	static constexpr size_t kOpenEnded = size_t(-1);
+
 private:
 	size_t total;
 	size_t block;
 	size_t limit;
 	size_t count;
 	std::list<Episode> data;
+	std::mutex mutex;
 };
@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * fixed pool of worker threads that run the items of one job at a time
+ *
+ * run(count, job) calls job(i, worker) for every i in [0, count), where worker is the index
+ * of the thread running it (0 is the calling thread, which takes items as well), and returns
+ * once every item is done and every worker is back to waiting
+ */
+class ThreadPool {
+public:
+	ThreadPool(unsigned threads = 1) : current(nullptr), job_count(0), next(0), pending(0), round(0), stop(false) {
+		for (unsigned w = 1; w < threads; w++) workers.emplace_back(&ThreadPool::work, this, w);
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread& t : workers) t.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator =(const ThreadPool&) = delete;
+
+	unsigned size() const { return workers.size() + 1; }
+
+	void run(size_t count, const std::function<void(size_t, unsigned)>& job) {
+		if (workers.empty() || count <= 1) {
+			for (size_t i = 0; i < count; i++) job(i, 0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current = &job;
+			job_count = count;
+			next = 0;
+			pending = workers.size();
+			round++;
+		}
+		wake.notify_all();
+		take();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&]() { return pending == 0; });
+		current = nullptr;
+	}
+
+protected:
+	void work(unsigned worker) {
+		size_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stop || round != seen; });
+				if (stop) return;
+				seen = round;
+			}
+			take(worker);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0) finished.notify_all();
+		}
+	}
+
+	/**
+	 * run items of the current job until none is left
+	 */
+	void take(unsigned worker = 0) {
+		for (size_t i; (i = next++) < job_count; ) (*current)(i, worker);
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable finished;
+
+	const std::function<void(size_t, unsigned)>* current;
+	size_t job_count;
+	std::atomic<size_t> next;
+	size_t pending;
+	size_t round;
+	bool stop;
+};
@@ -9,10 +9,18 @@
 #include <iostream>
 #include <iterator>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <random>
+#include <memory>
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistic.h"
+#include "benchmark.h"
+#include "bounded_queue.h"
 
 #define debug(a) std::cout << #a << " = " << a << std::endl
 #define print(a) std::cout << a << std::endl
@@ -23,8 +31,10 @@ int main(int argc, const char* argv[]) {
 	std::cout << std::endl << std::endl;
 
 	size_t total = 1000, block = 0, limit = 0;
+	unsigned threads = 1, actors = 0, interleave = 1;
+	size_t sync = 1000;
 	std::string play_args, evil_args;
-	std::string load, save;
+	std::string load, save, bench, replay;
 	bool summary = false;
 	for (int i = 1; i < argc; i++) {
 		std::string para(argv[i]);
@@ -44,9 +54,27 @@ int main(int argc, const char* argv[]) {
 			save = para.substr(para.find("=") + 1);
 		} else if (para.find("--summary") == 0) {
 			summary = true;
+		} else if (para.find("--threads=") == 0) {
+			threads = std::max(std::stoul(para.substr(para.find("=") + 1)), 1ul);
+		} else if (para.find("--actors=") == 0) {
+			actors = std::stoul(para.substr(para.find("=") + 1));
+		} else if (para.find("--sync=") == 0) {
+			sync = std::max(std::stoull(para.substr(para.find("=") + 1)), 1ull);
+		} else if (para.find("--interleave=") == 0) {
+			interleave = std::max(std::stoul(para.substr(para.find("=") + 1)), 1ul);
+		} else if (para.find("--replay=") == 0) {
+			replay = para.substr(para.find("=") + 1);
+		} else if (para.find("--bench=") == 0) {
+			bench = para.substr(para.find("=") + 1);
 		}
 	}
 
+	if (bench.size()) {
+		return Benchmark::run(bench) ? 0 : -1;
+	}
+
+	// a replay trains on every game of the episode logs, however many there are
+	if (replay.size()) total = Statistics::kOpenEnded;
 	Statistics stat(total, block, limit);
 
 	if (load.size()) {
@@ -56,13 +84,243 @@ int main(int argc, const char* argv[]) {
 		summary |= stat.is_finished();
 	}
 
-	TDPlayer play(play_args);
-	RandomEnv evil(evil_args);
-	Board::precompute_left();
-	Board::precompute_index();
+	// a bad argument or weight file fails here with a message rather than an abort
+	std::unique_ptr<TDPlayer> player;
+	std::unique_ptr<RandomEnv> environment;
+	try {
+		player.reset(new TDPlayer(play_args));
+		environment.reset(new RandomEnv(evil_args));
+	} catch (const std::bad_alloc&) {
+		std::cerr << "cannot allocate the weight tables of '" << play_args << "'" << std::endl;
+		return -1;
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+	TDPlayer& play = *player;
+	RandomEnv& evil = *environment;
+	if (replay.size() && play.play_mode != 0) {
+		std::cerr << "--replay is only supported in training mode" << std::endl;
+		return -1;
+	}
+	std::cout << (play.qnet.size() ? page_usage(play.qnet) : page_usage(play.weights())) << std::endl << std::endl;
+
+	// play one game of a training thread, which is recorded apart from 'stat' and merged later
+	auto play_episode = [](TDPlayer& learn, RandomEnv& env) {
+		learn.open_episode("~:" + env.name());
+		env.open_episode(learn.name() + ":~");
+
+		Episode game;
+		game.open_episode(learn.name() + ":" + env.name());
+		while (true) {
+			Agent& who = game.take_turns(learn, env);
+			Action move = who.take_action(game.state(), game.last_action());
+			if (!game.apply_action(move)) break;
+			if (who.check_for_win(game.state())) break;
+		}
+		Agent& win = game.last_turns(learn, env);
+		game.close_episode(win.name());
+		return game;
+	};
+	unsigned seed = std::random_device()();
+	if (evil_args.find("seed=") != std::string::npos) seed = std::stoul(evil.property("seed"));
+
+	if (play.play_mode == 0 && replay.size()) {
+		// train on the games of saved episode logs instead of playing, one log per thread at a time
+		std::vector<std::string> logs;
+		std::stringstream list(replay);
+		for (std::string log; std::getline(list, log, ','); ) logs.push_back(log);
+		std::atomic<size_t> next(0);
+
+		auto learn = [&](unsigned) {
+			TDPlayer learn(TDPlayer::Worker(), play);
+			for (size_t i; (i = next++) < logs.size(); ) {
+				std::ifstream in(logs[i], std::ios::in);
+				if (!in.is_open()) {
+					std::cerr << "cannot open episode log '" << logs[i] << "'" << std::endl;
+					continue;
+				}
+				for (std::string line; std::getline(in, line); ) {
+					if (line.empty()) continue;
+					Episode game;
+					std::stringstream(line) >> game;
+					learn.learn_episode(game.actions());
+					stat.merge(std::move(game));
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned id = 1; id < std::min<size_t>(threads, logs.size()); id++) workers.emplace_back(learn, id);
+		learn(0);
+		for (std::thread& t : workers) t.join();
+		stat.finish();
+
+	} else if (play.play_mode == 0 && actors > 0) {
+		// the actors play with a snapshot of the weights and pass their episodes to this thread,
+		// the only one that updates the weights; every 'sync' episodes it asks a copier thread for
+		// a new snapshot, which copies the tables while the learning goes on and then publishes it
+		typedef std::shared_ptr<std::vector<weight>> Snapshot;
+		Snapshot snapshot = std::make_shared<std::vector<weight>>(play.weights());
+		BoundedQueue<std::vector<TDPlayer::State>> queue(4 * actors);
+		size_t games = stat.remaining();
+		std::atomic<size_t> next(0);
+
+		auto act = [&](unsigned id) {
+			RandomEnv env(evil_args + " seed=" + std::to_string(seed + id));
+			Snapshot weights = std::atomic_load(&snapshot);
+			TDPlayer actor(TDPlayer::Worker(), play, *weights);
+			while (next++ < games) {
+				Snapshot latest = std::atomic_load(&snapshot);
+				if (latest != weights) actor.use_weights(*(weights = std::move(latest)));
+				Episode game = play_episode(actor, env);
+				queue.push_wait(std::move(actor.ep));
+
+				Agent& win = game.last_turns(actor, env);
+				actor.close_episode(win.name());
+				env.close_episode(win.name());
+				stat.merge(std::move(game));
+			}
+		};
+
+		std::mutex copy_mutex;
+		std::condition_variable copy_due;
+		bool copy_wanted = false, copy_stop = false;
+		// former snapshots, reused once no actor plays with them, and one allocated up front
+		std::vector<Snapshot> spare(1, std::make_shared<std::vector<weight>>(play.weights()));
+		auto copy = [&]() {
+			std::unique_lock<std::mutex> lock(copy_mutex);
+			while (true) {
+				copy_due.wait(lock, [&]() { return copy_wanted || copy_stop; });
+				if (copy_stop) return;
+				copy_wanted = false;
+				lock.unlock();
+
+				Snapshot fresh;
+				for (Snapshot& old : spare) {
+					if (old.use_count() != 1) continue;
+					fresh = std::move(old);
+					old = std::move(spare.back());
+					spare.pop_back();
+					break;
+				}
+				if (fresh) *fresh = play.weights();
+				else fresh = std::make_shared<std::vector<weight>>(play.weights());
+				spare.push_back(std::atomic_exchange(&snapshot, fresh));
+
+				lock.lock();
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned id = 0; id < actors; id++) workers.emplace_back(act, id);
+		std::thread copier(copy);
+		for (size_t learned = 0; learned < games; learned++) {
+			queue.pop_wait(play.ep);
+			play.td_training();
+			if ((learned + 1) % sync == 0) {
+				// a snapshot still being copied when the next one comes due covers both
+				std::lock_guard<std::mutex> lock(copy_mutex);
+				copy_wanted = true;
+				copy_due.notify_one();
+			}
+		}
+		for (std::thread& t : workers) t.join();
+		{
+			std::lock_guard<std::mutex> lock(copy_mutex);
+			copy_stop = true;
+			copy_due.notify_one();
+		}
+		copier.join();
+
+	} else if (play.play_mode == 0 && interleave > 1) {
+		// advance 'interleave' games in lockstep on this thread: the player moves of all of them
+		// prefetch their weights first and read them afterward, so their cache misses overlap
+		struct Slot {
+			std::unique_ptr<TDPlayer> learn;
+			std::unique_ptr<RandomEnv> env;
+			Episode game;
+			TDPlayer::PendingMove move;
+			bool active;
+		};
+		std::vector<Slot> slots(interleave);
+		size_t games = stat.remaining(), started = 0;
+
+		auto start = [&](Slot& slot) {
+			slot.active = started < games;
+			if (!slot.active) return;
+			started++;
+			slot.learn->open_episode("~:" + slot.env->name());
+			slot.env->open_episode(slot.learn->name() + ":~");
+			slot.game = Episode();
+			slot.game.open_episode(slot.learn->name() + ":" + slot.env->name());
+		};
+		auto finish = [&](Slot& slot) {
+			Agent& win = slot.game.last_turns(*slot.learn, *slot.env);
+			slot.game.close_episode(win.name());
+			slot.learn->td_training();
+			slot.learn->close_episode(win.name());
+			slot.env->close_episode(win.name());
+			stat.merge(std::move(slot.game));
+			start(slot);
+		};
+		// play the environment up to the next move of the player, starting new games as they end
+		auto ready = [&](Slot& slot) {
+			while (slot.active) {
+				Agent& who = slot.game.take_turns(*slot.learn, *slot.env);
+				if (&who == slot.learn.get()) return true;
+				Action move = who.take_action(slot.game.state(), slot.game.last_action());
+				if (!slot.game.apply_action(move) || who.check_for_win(slot.game.state())) finish(slot);
+			}
+			return false;
+		};
+
+		for (unsigned id = 0; id < interleave; id++) {
+			slots[id].learn.reset(new TDPlayer(TDPlayer::Worker(), play));
+			slots[id].env.reset(new RandomEnv(evil_args + " seed=" + std::to_string(seed + id)));
+			start(slots[id]);
+		}
+		for (bool active = true; active; ) {
+			active = false;
+			for (Slot& slot : slots) {
+				if (ready(slot)) slot.learn->prepare_move(slot.game.state(), slot.move);
+			}
+			for (Slot& slot : slots) {
+				if (!slot.active) continue;
+				slot.game.take_turns(*slot.learn, *slot.env); // restart the clock of the move
+				Action move = slot.learn->finish_move(slot.game.state(), slot.move);
+				if (!slot.game.apply_action(move) || slot.learn->check_for_win(slot.game.state())) finish(slot);
+				active |= slot.active;
+			}
+		}
+
+	} else if (play.play_mode == 0 && threads > 1) {
+		// each thread trains on its own games, all of them update the weights of 'play' without locking
+		size_t games = stat.remaining();
+		std::atomic<size_t> next(0);
+
+		auto train = [&](unsigned id) {
+			TDPlayer learn(TDPlayer::Worker(), play);
+			RandomEnv env(evil_args + " seed=" + std::to_string(seed + id));
+			while (next++ < games) {
+				Episode game = play_episode(learn, env);
+				learn.td_training();
+
+				Agent& win = game.last_turns(learn, env);
+				learn.close_episode(win.name());
+				env.close_episode(win.name());
+				stat.merge(std::move(game));
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (unsigned id = 1; id < threads; id++) workers.emplace_back(train, id);
+		train(0);
+		for (std::thread& t : workers) t.join();
+	}
 
 	int num_games = 0;
-	while (!stat.is_finished()) {
+	while (replay.empty() && !stat.is_finished()) {
 	    num_games++;
 		play.open_episode("~:" + evil.name());
 		evil.open_episode(play.name() + ":~");
@@ -88,6 +346,21 @@ int main(int argc, const char* argv[]) {
 		stat.summary();
 	}
 
+	if (play.checkpoint) {
+		play.checkpoint->flush();
+		std::cout << *play.checkpoint << std::endl;
+	}
+
+	if (play.play_mode == 1) {
+		for (auto& sr : play.searchers) std::cout << sr << std::endl;
+		double error = 0;
+		for (size_t i = 0; i < play.qnet.size(); i++) {
+			std::cout << "quant: table " << i << ", " << play.qnet[i] << std::endl;
+			error += play.qnet[i].max_error * play.iso;
+		}
+		if (play.qnet.size()) std::cout << "quant: value error at most " << error << std::endl;
+	}
+
 	if (save.size()) {
 		std::ofstream out(save, std::ios::out | std::ios::trunc);
 		out << stat;
@@ -0,0 +1,146 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * fixed-size transposition table for the expectimax search
+ *
+ * an entry is keyed on the 64-bit board together with the remaining depth and the node type,
+ * and a lookup only hits on the exact same depth, so cached values are the values the search
+ * would have computed anyway
+ * an entry also keeps the best move of its node, which a lookup at any other depth returns as
+ * a hint for which move to search first, e.g. from the previous iteration of a deepening search
+ *
+ * the table is an array of 64-byte buckets holding 4 entries each
+ * a store overwrites the entry of the same position if the bucket has one, otherwise it takes
+ * an empty entry, or else evicts the entry from the oldest search with the smallest depth
+ */
+class TranspositionTable {
+public:
+	TranspositionTable(size_t bytes = 0) : buckets(nullptr, std::free), mask(0), generation(0) {
+		resize(bytes);
+	}
+
+	/**
+	 * reallocate the table to the largest power-of-two number of buckets within 'bytes'
+	 * an empty table (less than one bucket) never hits and ignores stores
+	 */
+	void resize(size_t bytes) {
+		size_t count = 0;
+		while ((sizeof(Bucket) << (count + 1)) <= bytes) count++;
+		buckets.reset();
+		mask = 0;
+		if (bytes >= sizeof(Bucket)) {
+			void* data = nullptr;
+			if (posix_memalign(&data, sizeof(Bucket), sizeof(Bucket) << count) != 0) return;
+			buckets.reset(static_cast<Bucket*>(data));
+			mask = (size_t(1) << count) - 1;
+		}
+		clear();
+	}
+
+	void clear() {
+		if (buckets) std::memset(buckets.get(), 0, sizeof(Bucket) * (mask + 1));
+		generation = 0;
+		probes = hits = stores = evictions = 0;
+	}
+
+	/**
+	 * mark the start of a new root search, entries of older searches are evicted first
+	 */
+	void new_search() {
+		generation++;
+	}
+
+	/**
+	 * return whether the entry of the exact depth is cached, and otherwise set 'move' to the best
+	 * move cached at another depth if any (it is left unchanged if none is)
+	 */
+	bool lookup(uint64_t key, unsigned depth, unsigned type, float& value, int& move) {
+		if (!buckets) return false;
+		probes++;
+		Bucket& bucket = buckets.get()[index(key)];
+		for (Entry& e : bucket.entry) {
+			if (e.key != key || e.type != type + 1) continue;
+			if (e.depth == depth) {
+				value = e.value;
+				hits++;
+				return true;
+			}
+			if (e.move != kNoMove) move = e.move;
+		}
+		return false;
+	}
+
+	bool lookup(uint64_t key, unsigned depth, unsigned type, float& value) {
+		int move;
+		return lookup(key, depth, type, value, move);
+	}
+
+	void store(uint64_t key, unsigned depth, unsigned type, float value, int move = -1) {
+		if (!buckets) return;
+		stores++;
+		Bucket& bucket = buckets.get()[index(key)];
+		Entry* victim = &bucket.entry[0];
+		for (Entry& e : bucket.entry) {
+			if (e.type == 0 || (e.key == key && e.type == type + 1 && e.depth == depth)) {
+				victim = &e;
+				break;
+			}
+			if (rank(e) < rank(*victim)) victim = &e;
+		}
+		if (victim->type != 0 && victim->key != key) evictions++;
+		*victim = { key, value, uint8_t(depth), uint8_t(type + 1), generation, uint8_t(move < 0 ? kNoMove : move) };
+	}
+
+	size_t size() const { return buckets ? (mask + 1) * 4 : 0; }
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const TranspositionTable& tt) {
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << "tt: " << tt.size() << " entries, " << tt.probes << " probes, " << tt.hits << " hits";
+		out << std::fixed << std::setprecision(2) << " (" << (tt.probes ? tt.hits * 100.0 / tt.probes : 0) << "%), ";
+		out << tt.stores << " stores, " << tt.evictions << " evictions";
+		out.copyfmt(ff);
+		return out;
+	}
+
+	size_t probes;
+	size_t hits;
+	size_t stores;
+	size_t evictions;
+
+protected:
+	struct Entry {
+		uint64_t key;
+		float value;
+		uint8_t depth;
+		uint8_t type; // node type + 1, 0 for an empty entry
+		uint8_t age;
+		uint8_t move; // best move of the node, kNoMove if unknown
+	};
+
+	static constexpr uint8_t kNoMove = 0xff;
+
+	struct alignas(64) Bucket {
+		Entry entry[4];
+	};
+
+	size_t index(uint64_t key) const {
+		return (key * 0x9e3779b97f4a7c15ull) >> 32 & mask;
+	}
+
+	unsigned rank(const Entry& e) const {
+		return (e.age == generation ? 256u : 0u) + e.depth;
+	}
+
+private:
+	std::unique_ptr<Bucket, decltype(&std::free)> buckets;
+	size_t mask;
+	uint8_t generation;
+};
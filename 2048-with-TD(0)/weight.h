@@ -9,39 +9,419 @@
 
 #pragma once
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <utility>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <cstdio>
+#include <cerrno>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <new>
+#include <iomanip>
+
+/**
+ * allocator backing large tables with 2 MB huge pages, since random lookups into tables far
+ * larger than the TLB reach otherwise miss the TLB on almost every access
+ *
+ * an allocation of at least one huge page is taken from the reserved huge pages (MAP_HUGETLB)
+ * if the system has enough of them, otherwise it is mapped on a 2 MB boundary and advised to
+ * use transparent huge pages (MADV_HUGEPAGE); smaller allocations use operator new
+ */
+template<typename T>
+class huge_page_allocator {
+public:
+	typedef T value_type;
+
+	huge_page_allocator() noexcept {}
+	template<typename U> huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+	T* allocate(size_t n) {
+		size_t bytes = n * sizeof(T);
+		if (bytes < kHugePage) return static_cast<T*>(::operator new(bytes));
+		bytes = round(bytes);
+#if defined(MAP_HUGETLB)
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined(MAP_HUGE_SHIFT)
+		flags |= 21 << MAP_HUGE_SHIFT; // 2 MB pages, even if the default huge page size differs
+#endif
+		void* huge = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (huge != MAP_FAILED) return static_cast<T*>(huge);
+#endif
+		// map one huge page more than needed, then unmap the ends outside the 2 MB boundaries
+		size_t span = bytes + kHugePage;
+		void* addr = ::mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) throw std::bad_alloc();
+		char* base = static_cast<char*>(addr);
+		char* start = reinterpret_cast<char*>(round(reinterpret_cast<uintptr_t>(base)));
+		if (start != base) ::munmap(base, start - base);
+		::munmap(start + bytes, base + span - (start + bytes));
+#if defined(MADV_HUGEPAGE)
+		::madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+		return reinterpret_cast<T*>(start);
+	}
+
+	void deallocate(T* p, size_t n) noexcept {
+		size_t bytes = n * sizeof(T);
+		if (bytes < kHugePage) ::operator delete(p);
+		else ::munmap(p, round(bytes));
+	}
+
+	static constexpr size_t kHugePage = size_t(2) << 20;
+
+protected:
+	static size_t round(size_t bytes) { return (bytes + kHugePage - 1) & ~(kHugePage - 1); }
+};
+
+template<typename T, typename U>
+bool operator ==(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept { return true; }
+template<typename T, typename U>
+bool operator !=(const huge_page_allocator<T>&, const huge_page_allocator<U>&) noexcept { return false; }
 
 class weight {
 public:
-	weight() {}
-	weight(size_t len) : value(len) {}
-	weight(size_t len, float value) : value(len, value) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
-	weight(const weight& f) = default;
+	weight() : data(nullptr), length(0) {}
+	weight(size_t len) : value(len), data(value.data()), length(len) {}
+	weight(size_t len, float value) : value(len, value), data(this->value.data()), length(len) {}
+	weight(weight&& f) noexcept : value(std::move(f.value)), data(f.data), length(f.length) { f.data = nullptr; f.length = 0; }
+	weight(const weight& f) : value(f.data, f.data + f.length), data(value.data()), length(f.length) {}
 
-	weight& operator =(const weight& f) = default;
-	float& operator[] (size_t i) { return value[i]; }
-	const float& operator[] (size_t i) const { return value[i]; }
-	size_t size() const { return value.size(); }
+	weight& operator =(const weight& f) {
+		if (this != &f) {
+			value.assign(f.data, f.data + f.length);
+			data = value.data();
+			length = f.length;
+		}
+		return *this;
+	}
+	weight& operator =(weight&& f) noexcept {
+		value = std::move(f.value);
+		data = f.data;  length = f.length;
+		f.data = nullptr;  f.length = 0;
+		return *this;
+	}
+
+	/**
+	 * a table over memory owned elsewhere, e.g. a mapped weight file, which must outlive the table
+	 * a copy of the table owns its entries again
+	 */
+	static weight view(float* data, size_t len) {
+		weight w;
+		w.data = data;
+		w.length = len;
+		return w;
+	}
+
+	float& operator[] (size_t i) { return data[i]; }
+	const float& operator[] (size_t i) const { return data[i]; }
+	size_t size() const { return length; }
+	void prefetch(size_t i) const { __builtin_prefetch(data + i); }
+	const void* base() const { return data; }
+	size_t bytes() const { return sizeof(float) * length; }
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-		auto& value = w.value;
-		uint64_t size = value.size();
+		uint64_t size = w.length;
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(float) * size);
+		out.write(reinterpret_cast<const char*>(w.data), sizeof(float) * size);
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, weight& w) {
-		auto& value = w.value;
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(float) * size);
+		w.value.resize(size);
+		in.read(reinterpret_cast<char*>(w.value.data()), sizeof(float) * size);
+		w.data = w.value.data();
+		w.length = size;
 		return in;
 	}
 
 protected:
-	std::vector<float> value;
+	std::vector<float, huge_page_allocator<float>> value;
+	float* data;
+	size_t length;
+};
+
+/**
+ * version 2 weight file, which is mapped into memory instead of being read
+ *
+ * the file starts with a header (magic, version, number of tables, layout length, checksum),
+ * followed by the offset and size of every table and the layout string of the network,
+ * and then the tables themselves, each starting on a page boundary
+ * the checksum covers the entries of all tables
+ *
+ * the tables are mapped copy-on-write, so processes that only read them share one physical
+ * copy through the page cache, and a process that trains them gets private pages as it writes
+ */
+class weight_file {
+public:
+	/**
+	 * whether the file at 'path' is in this format, and not in the former stream format
+	 */
+	static bool detect(const std::string& path) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		char magic[8] = {};
+		in.read(magic, sizeof(magic));
+		return in && std::equal(magic, magic + sizeof(magic), kMagic());
+	}
+
+	/**
+	 * map the file and point 'net' at its tables, return the mapping that keeps them alive
+	 * 'layout' is set to the layout string stored in the file
+	 * throw std::runtime_error if the file cannot be mapped or is malformed, or if 'verify'
+	 * is set and the checksum does not match
+	 */
+	static std::shared_ptr<void> load(const std::string& path, std::vector<weight>& net, std::string& layout, bool verify = false) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("cannot open weight file '" + path + "'");
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+			::close(fd);
+			throw std::runtime_error("weight file '" + path + "' is truncated");
+		}
+		size_t length = st.st_size;
+		void* addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED) throw std::runtime_error("cannot map weight file '" + path + "'");
+		std::shared_ptr<void> mapping(addr, [length](void* p) { ::munmap(p, length); });
+
+		char* base = static_cast<char*>(addr);
+		const Header& head = *reinterpret_cast<const Header*>(base);
+		if (!std::equal(head.magic, head.magic + sizeof(head.magic), kMagic()) || head.version != kVersion)
+			throw std::runtime_error("weight file '" + path + "' is not a version " + std::to_string(kVersion) + " weight file");
+		size_t layout_at = sizeof(Header) + sizeof(Table) * size_t(head.count);
+		if (layout_at + head.layout > length)
+			throw std::runtime_error("weight file '" + path + "' is truncated");
+
+		const Table* table = reinterpret_cast<const Table*>(base + sizeof(Header));
+		std::vector<weight> tables;
+		uint64_t checksum = kChecksumSeed;
+		for (size_t i = 0; i < head.count; i++) {
+			if (table[i].offset % kPage || table[i].offset > length || table[i].size > (length - table[i].offset) / sizeof(float))
+				throw std::runtime_error("weight file '" + path + "' is truncated");
+			float* data = reinterpret_cast<float*>(base + table[i].offset);
+			if (verify) checksum = hash(data, table[i].size, checksum);
+			tables.push_back(weight::view(data, table[i].size));
+		}
+		if (verify && checksum != head.checksum)
+			throw std::runtime_error("weight file '" + path + "' fails its checksum");
+
+		layout.assign(base + layout_at, head.layout);
+		net = std::move(tables);
+		return mapping;
+	}
+
+	/**
+	 * write 'net' with its layout string, throw std::runtime_error if the file cannot be written
+	 * the file is written and synced under a temporary name of its own and then renamed over
+	 * 'path', whose directory is synced last, so 'path' always holds a complete file even after
+	 * a crash, a process still mapping the former file keeps it, and concurrent saves to the same
+	 * path never write into the same temporary file
+	 */
+	static void save(const std::string& path, const std::vector<weight>& net, const std::string& layout) {
+		Header head = {};
+		std::copy(kMagic(), kMagic() + sizeof(head.magic), head.magic);
+		head.version = kVersion;
+		head.count = net.size();
+		head.layout = layout.size();
+		head.checksum = kChecksumSeed;
+		std::vector<Table> table(net.size());
+		uint64_t offset = align(sizeof(Header) + sizeof(Table) * table.size() + layout.size());
+		for (size_t i = 0; i < net.size(); i++) {
+			table[i] = { offset, net[i].size() };
+			offset = align(offset + sizeof(float) * net[i].size());
+			head.checksum = hash(&net[i][0], net[i].size(), head.checksum);
+		}
+
+		static std::atomic<unsigned> serial(0);
+		std::string temp = path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(serial++);
+		std::ofstream out(temp, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) throw std::runtime_error("cannot open weight file '" + temp + "' for writing");
+		out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+		out.write(reinterpret_cast<const char*>(table.data()), sizeof(Table) * table.size());
+		out.write(layout.data(), layout.size());
+		for (size_t i = 0; i < net.size(); i++) {
+			pad(out, table[i].offset);
+			out.write(reinterpret_cast<const char*>(&net[i][0]), sizeof(float) * net[i].size());
+		}
+		out.close();
+		if (!out) {
+			std::remove(temp.c_str());
+			throw std::runtime_error("cannot write weight file '" + temp + "'");
+		}
+
+		int fd = ::open(temp.c_str(), O_RDONLY);
+		bool synced = fd >= 0 && ::fsync(fd) == 0;
+		if (fd >= 0) ::close(fd);
+		if (!synced || std::rename(temp.c_str(), path.c_str()) != 0) {
+			std::remove(temp.c_str());
+			throw std::runtime_error("cannot replace weight file '" + path + "'");
+		}
+
+		// the rename is only durable once the directory holding 'path' is synced too
+		size_t slash = path.find_last_of('/');
+		std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+		int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		synced = dfd >= 0 && (::fsync(dfd) == 0 || errno == EINVAL);
+		if (dfd >= 0) ::close(dfd);
+		if (!synced) throw std::runtime_error("cannot sync the directory of weight file '" + path + "'");
+	}
+
+protected:
+	static const char* kMagic() { return "TDWEIGHT"; }
+	static constexpr uint32_t kVersion = 2;
+	static constexpr uint64_t kPage = 4096;
+	static constexpr uint64_t kChecksumSeed = 0xcbf29ce484222325ull;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t count;   // number of tables
+		uint32_t layout;  // length of the layout string
+		uint32_t reserved;
+		uint64_t checksum;
+	};
+
+	struct Table {
+		uint64_t offset;  // in bytes from the start of the file, a multiple of kPage
+		uint64_t size;    // in entries
+	};
+
+	static uint64_t align(uint64_t offset) {
+		return (offset + kPage - 1) / kPage * kPage;
+	}
+
+	static void pad(std::ostream& out, uint64_t offset) {
+		for (uint64_t at = out.tellp(); at < offset; at++) out.put(0);
+	}
+
+	/**
+	 * FNV-1a over the entries, one 32-bit entry at a time
+	 */
+	static uint64_t hash(const float* data, size_t size, uint64_t h) {
+		const uint32_t* word = reinterpret_cast<const uint32_t*>(data);
+		for (size_t i = 0; i < size; i++) h = (h ^ word[i]) * 0x100000001b3ull;
+		return h;
+	}
+};
+
+/**
+ * 16-bit quantized copy of a weight table for inference only, half the size of the float table
+ * each entry is stored as round(value / scale) with one scale per table, so that the largest
+ * magnitude maps to 32767 and every entry is off by at most scale / 2
+ */
+class qweight {
+public:
+	qweight() : scale(1), max_error(0), rms_error(0) {}
+	qweight(const weight& w) : value(w.size()), scale(1), max_error(0), rms_error(0) {
+		float max = 0;
+		for (size_t i = 0; i < w.size(); i++) max = std::max(max, std::abs(w[i]));
+		if (max > 0) scale = max / 32767;
+
+		double sum = 0;
+		for (size_t i = 0; i < w.size(); i++) {
+			value[i] = int16_t(std::max(-32767.0f, std::min(32767.0f, std::round(w[i] / scale))));
+			double error = std::abs(double(w[i]) - double((*this)[i]));
+			max_error = std::max(max_error, error);
+			sum += error * error;
+		}
+		rms_error = w.size() ? std::sqrt(sum / w.size()) : 0;
+	}
+
+	float operator[] (size_t i) const { return scale * value[i]; }
+	size_t size() const { return value.size(); }
+	void prefetch(size_t i) const { __builtin_prefetch(value.data() + i); }
+	const void* base() const { return value.data(); }
+	size_t bytes() const { return sizeof(int16_t) * value.size(); }
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const qweight& w) {
+		return out << "scale = " << w.scale << ", max error = " << w.max_error << ", rms error = " << w.rms_error;
+	}
+
+protected:
+	std::vector<int16_t, huge_page_allocator<int16_t>> value;
+	float scale;
+
+public:
+	double max_error; // error against the float table it was made from
+	double rms_error;
+};
+
+/**
+ * how the memory of a set of tables is paged, as reported by the kernel in /proc/self/smaps:
+ * the tables on a 2 MB boundary, and the size of the mappings holding the tables that use
+ * reserved huge pages, that are advised to use transparent huge pages, and that actually do
+ */
+class page_usage {
+public:
+	template<typename table>
+	page_usage(const std::vector<table>& tables) : count(tables.size()), total(0), aligned(0), mapped(0), hugetlb(0), advised(0), huge(0) {
+		for (const table& t : tables) {
+			uintptr_t base = reinterpret_cast<uintptr_t>(t.base());
+			ranges.emplace_back(base, base + t.bytes());
+			total += t.bytes();
+			aligned += (base % huge_page_allocator<char>::kHugePage == 0);
+		}
+		scan();
+	}
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const page_usage& u) {
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << std::fixed << std::setprecision(1);
+		out << "pages: " << u.count << " tables of " << (u.total / 1048576.0) << " MB, " << u.aligned << " aligned to 2 MB, ";
+		out << "mapped in " << (u.mapped / 1048576.0) << " MB with " << (u.hugetlb / 1048576.0) << " MB hugetlb, ";
+		out << (u.advised / 1048576.0) << " MB advised, " << (u.huge / 1048576.0) << " MB on transparent huge pages";
+		out.copyfmt(ff);
+		return out;
+	}
+
+protected:
+	/**
+	 * add up the mappings overlapping any of the tables, each mapping being a header line
+	 * 'start-end perms ...' followed by lines of 'Field: value'
+	 */
+	void scan() {
+		std::ifstream smaps("/proc/self/smaps");
+		bool overlap = false;
+		size_t size = 0;
+		for (std::string line; std::getline(smaps, line); ) {
+			unsigned long long lo, hi;
+			size_t kb = 0;
+			if (std::sscanf(line.c_str(), "%llx-%llx ", &lo, &hi) == 2) {
+				overlap = std::any_of(ranges.begin(), ranges.end(), [&](const std::pair<uintptr_t, uintptr_t>& r) { return r.first < hi && lo < r.second; });
+				size = hi - lo;
+				if (overlap) mapped += size;
+			} else if (!overlap) {
+				continue;
+			} else if (std::sscanf(line.c_str(), "KernelPageSize: %zu kB", &kb) == 1) {
+				if (kb >= 2048) hugetlb += size;
+			} else if (std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1) {
+				huge += kb << 10;
+			} else if (line.find("VmFlags:") == 0) {
+				if ((line + ' ').find(" hg ") != std::string::npos) advised += size;
+			}
+		}
+	}
+
+private:
+	std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+	size_t count;
+	size_t total;
+	size_t aligned;
+	size_t mapped;
+	size_t hugetlb;
+	size_t advised;
+	size_t huge;
 };